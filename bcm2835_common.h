@@ -16,4 +16,12 @@ extern hwaddr bcm2835_vcram_base;
 #define MBOX_SIZE       32
 #define MBOX_INVALID_DATA   0x0f
 
+/* DMA DREQ lines, as selected by the PER_MAP field of a control block.
+ * Peripherals raise their line while their FIFO can supply or accept
+ * data; line 0 is permanently active.
+ */
+#define DREQ_EMMC       11
+#define DREQ_SDHOST     13
+#define DREQ_COUNT      32
+
 #endif
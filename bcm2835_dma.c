@@ -6,10 +6,23 @@
 #include "sysbus.h"
 #include "qemu-common.h"
 #include "qdev.h"
+#include "exec/address-spaces.h"
+#include "exec/cpu-common.h"
+#include "qemu/timer.h"
+#include "qemu/main-loop.h"
+#include "qapi/visitor.h"
+#include "block/thread-pool.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "bcm2835_common.h"
+#include "bcm2835_stats.h"
 
 /* DMA CS Control and Status bits */
 #define BCM2708_DMA_ACTIVE      (1 << 0)
 #define BCM2708_DMA_INT         (1 << 2)
+#define BCM2708_DMA_DREQ        (1 << 3)  /* State of the selected DREQ */
 #define BCM2708_DMA_ISPAUSED    (1 << 4)  /* Pause requested or not active */
 #define BCM2708_DMA_ISHELD      (1 << 5)  /* Is held by DREQ flow control */
 #define BCM2708_DMA_ERR         (1 << 8)
@@ -25,14 +38,20 @@
 #define BCM2708_DMA_D_INC       (1 << 4)
 #define BCM2708_DMA_D_WIDTH     (1 << 5)
 #define BCM2708_DMA_D_DREQ      (1 << 6)
+#define BCM2708_DMA_D_IGNORE    (1 << 7)
 #define BCM2708_DMA_S_INC       (1 << 8)
 #define BCM2708_DMA_S_WIDTH     (1 << 9)
 #define BCM2708_DMA_S_DREQ      (1 << 10)
+#define BCM2708_DMA_S_IGNORE    (1 << 11)
 
 #define BCM2708_DMA_BURST(x)    (((x)&0xf) << 12)
 #define BCM2708_DMA_PER_MAP(x)  ((x) << 16)
 #define BCM2708_DMA_WAITS(x)    (((x)&0x1f) << 21)
 
+#define BCM2708_DMA_GET_BURST(ti)   (((ti) >> 12) & 0xf)
+#define BCM2708_DMA_GET_PER_MAP(ti) (((ti) >> 16) & 0x1f)
+#define BCM2708_DMA_GET_WAITS(ti)   (((ti) >> 21) & 0x1f)
+
 #define BCM2708_DMA_DREQ_EMMC   11
 #define BCM2708_DMA_DREQ_SDHOST 13
 
@@ -48,6 +67,64 @@
 
 #define BCM2708_DMA_TDMODE_LEN(w, h) ((h) << 16 | (w))
 
+#define BCM2708_DMA_CB_SIZE     32 /* bytes fetched per control block */
+#define BCM2708_DMA_CS_WMASK    0x30ff0001
+
+#define BCM2708_DMA_CBCACHE_SIZE 16
+
+/* Control block cached per channel and keyed on its address, along with
+ * the host pointer it was read from. A hit still compares the words
+ * against guest RAM, so CBs rewritten by the guest or by DMA are picked
+ * up without any write tracking; what it saves is the bus address
+ * translation.
+ */
+typedef struct {
+    uint32_t addr;          /* bus address of the CB, 0 if unused */
+    uint32_t cb[6];         /* ti, source_ad, dest_ad, txfr_len, stride,
+                               nextconbk, as little-endian words */
+    uint8_t *host;          /* host pointer to the CB in RAM */
+} dmacbentry;
+
+#define BCM2708_DMA_MAX_WORKERS 8
+
+#define BCM2708_DMA_DEBUG_READ_ERROR    (1 << 2)
+#define BCM2708_DMA_DEBUG_ERRORS        0x7
+
+#define BCM2708_DMA_TLB_SIZE    64
+#define BCM2708_DMA_TLB_PAGE    4096
+
+/* Bus address translation, cached per 4K bus page */
+typedef struct {
+    int valid;
+    uint32_t bus;           /* bus address of the page */
+    hwaddr phys;            /* matching physical address */
+    MemoryRegion *mr;       /* region backing the page */
+    ram_addr_t offset;      /* offset of the page within mr */
+    uint8_t *host;          /* host pointer for RAM pages, NULL for MMIO */
+    uint64_t extent;        /* contiguous RAM bytes from the page start */
+    int readonly;
+} dmatlbentry;
+
+/* Slice of a large RAM to RAM copy handed to a host worker thread */
+typedef struct {
+    void *s;
+    int chan;
+    uint8_t *dst;
+    const uint8_t *src;
+    size_t len;
+} dmacopyjob;
+
+/* Per-channel activity counters */
+typedef struct {
+    uint64_t cbs;           /* control blocks executed */
+    uint64_t bytes;         /* bytes moved */
+    uint64_t fill_cbs;      /* CBs with SRC_IGNORE set */
+    uint64_t copy_cbs;      /* unpaced memory to memory CBs */
+    uint64_t periph_cbs;    /* DREQ-paced CBs */
+    uint64_t offload_cbs;   /* CBs handed to host threads */
+    bcm2835_hist latency;   /* ns from ACTIVE (or previous INT) to INT */
+} dmastats;
+
 typedef struct {
     uint32_t cs;
     uint32_t conblk_ad;
@@ -58,6 +135,28 @@ typedef struct {
     uint32_t stride;
     uint32_t nextconbk;
     uint32_t debug;
+
+    uint32_t xlength;   /* 2D mode row length, reloaded for each row */
+    int cb_loaded;      /* a CB has been fetched and is in progress */
+    uint32_t first_cb;  /* first CB of the running chain, 0 if none */
+    int cyclic;         /* the chain came back to first_cb */
+
+    dmacbentry cbcache[BCM2708_DMA_CBCACHE_SIZE];
+    uint64_t cbcache_hits;
+    uint64_t cbcache_misses;
+
+    /* In-flight host thread copy of the current CB */
+    int offload_pending;    /* outstanding worker jobs */
+    int offload_aborted;    /* CB dropped by ABORT/RESET meanwhile */
+    uint8_t *offload_src;
+    uint8_t *offload_dst;
+    hwaddr offload_slen;
+    hwaddr offload_dlen;
+    uint32_t offload_len;
+    dmacopyjob offload_job[BCM2708_DMA_MAX_WORKERS];
+
+    dmastats stats;
+    int64_t active_ns;      /* vm_clock when ACTIVE was set */
     
     qemu_irq irq;
 } dmachan;
@@ -70,61 +169,741 @@ typedef struct {
     dmachan chan[16];
     uint32_t int_status;
     uint32_t enable;
+    uint32_t dreq;          /* DREQ lines currently asserted */
+
+    /* Channel scheduler */
+    QEMUBH *bh;
+    QEMUTimer *timer;
+    int rr_next;
+    uint32_t slice_bytes;   /* per-channel budget for each slice */
+    uint32_t bandwidth;     /* modeled bus bandwidth in bytes/s, 0 = none */
+    uint32_t backoff_us;    /* slice period for paced or cyclic channels */
+
+    uint32_t offload_threshold; /* min CB size for host threads, 0 = off */
+    uint32_t offload_workers;
+
+    dmatlbentry tlb[BCM2708_DMA_TLB_SIZE];
+    uint64_t tlb_hits;
+    uint64_t tlb_misses;
     
 } bcm2835_dma_state;
 
 
-static void bcm2835_dma_update(bcm2835_dma_state *s, int c) 
+/* Resolve a VideoCore bus address to a TLB entry. Bus addresses decode
+ * as follows:
+ *   0x7e000000 - 0x7effffff  peripherals, at BCM2708_PERI_BASE
+ *   0xX0000000 - 0xX3ffffff  SDRAM through one of the four cache aliases
+ * Anything else, or SDRAM beyond the installed RAM, is a bus error and
+ * NULL is returned.
+ */
+static dmatlbentry *bcm2835_dma_tlb_lookup(bcm2835_dma_state *s,
+    uint32_t bus)
+{
+    uint32_t page = bus & ~(BCM2708_DMA_TLB_PAGE - 1);
+    dmatlbentry *e;
+    MemoryRegionSection section;
+    hwaddr phys;
+
+    e = &s->tlb[(page / BCM2708_DMA_TLB_PAGE) % BCM2708_DMA_TLB_SIZE];
+    if (e->valid && e->bus == page) {
+        s->tlb_hits++;
+        return e;
+    }
+    s->tlb_misses++;
+
+    if ((page >> 24) == 0x7e) {
+        phys = (page & 0x00ffffff) + BCM2708_PERI_BASE;
+    } else {
+        phys = page & 0x3fffffff;
+        if (phys >= bcm2835_vcram_base + VCRAM_SIZE) {
+            return NULL;
+        }
+    }
+
+    section = memory_region_find(get_system_memory(), phys,
+        BCM2708_DMA_TLB_PAGE);
+    if (!section.mr) {
+        return NULL;
+    }
+
+    e->valid = 1;
+    e->bus = page;
+    e->phys = phys;
+    e->mr = section.mr;
+    e->offset = section.offset_within_region;
+    e->readonly = section.readonly;
+    if (memory_region_is_ram(section.mr)) {
+        e->host = (uint8_t *)memory_region_get_ram_ptr(section.mr)
+            + section.offset_within_region;
+        e->extent = memory_region_size(section.mr)
+            - section.offset_within_region;
+    } else {
+        e->host = NULL;
+        e->extent = 0;
+    }
+    return e;
+}
+
+/* The raspi memory map is fixed once the board is built and RAM never
+ * moves, so this is only needed when the controller is initialized.
+ */
+static void bcm2835_dma_tlb_flush(bcm2835_dma_state *s)
+{
+    int i;
+
+    for (i = 0; i < BCM2708_DMA_TLB_SIZE; i++) {
+        s->tlb[i].valid = 0;
+    }
+}
+
+/* Bus error: flag it, stop the channel and let the driver know */
+static void bcm2835_dma_error(bcm2835_dma_state *s, int c, uint32_t bus,
+    uint32_t debug)
 {
     dmachan *ch = &s->chan[c];
-    uint32_t data;
-    
-    if (!(s->enable & (1 << c)))
-        return;
-    
-    while ((s->enable & (1 << c)) && (ch->conblk_ad != 0)) {
-        // CB fetch
-        ch->ti = ldl_phys(ch->conblk_ad);
-        ch->source_ad = ldl_phys(ch->conblk_ad + 4);
-        ch->dest_ad = ldl_phys(ch->conblk_ad + 8);
-        ch->txfr_len = ldl_phys(ch->conblk_ad + 12);
-        ch->stride = ldl_phys(ch->conblk_ad + 16);
-        ch->nextconbk = ldl_phys(ch->conblk_ad + 20);
-
-        assert(!(ch->ti & BCM2708_DMA_TDMODE));
-        
-        while(ch->txfr_len != 0) {
+
+    qemu_log_mask(LOG_GUEST_ERROR,
+        "bcm2835_dma: channel %d: bad bus address %08x\n", c, bus);
+
+    ch->cs |= BCM2708_DMA_ERR;
+    ch->cs &= ~BCM2708_DMA_ACTIVE;
+    ch->debug |= debug;
+    ch->cb_loaded = 0;
+    if (ch->ti & BCM2708_DMA_INT_EN) {
+        ch->cs |= BCM2708_DMA_INT;
+        s->int_status |= (1 << c);
+        qemu_set_irq(ch->irq, 1);
+    }
+}
+
+/* Translate a bus address for a word access, NULL on bus error */
+static dmatlbentry *bcm2835_dma_translate(bcm2835_dma_state *s, int c,
+    uint32_t bus, int is_write)
+{
+    dmatlbentry *e = bcm2835_dma_tlb_lookup(s, bus);
+
+    if (!e) {
+        bcm2835_dma_error(s, c, bus,
+            is_write ? 0 : BCM2708_DMA_DEBUG_READ_ERROR);
+    }
+    return e;
+}
+
+/* Get direct host access to a RAM range at a bus address. Returns NULL
+ * when the range does not start in RAM, in which case the caller has to
+ * go through the regular MMIO dispatch. *plen is clipped to the
+ * contiguous RAM. Reads use the host pointer cached in the TLB; writes
+ * still go through cpu_physical_memory_map(), so that the matching
+ * bcm2835_dma_unmap() marks the pages dirty and invalidates translated
+ * code.
+ */
+static uint8_t *bcm2835_dma_map(bcm2835_dma_state *s, uint32_t bus,
+    hwaddr *plen, int is_write)
+{
+    dmatlbentry *e = bcm2835_dma_tlb_lookup(s, bus);
+    uint32_t off;
+
+    if (!e || !e->host || (is_write && e->readonly)) {
+        return NULL;
+    }
+    off = bus - e->bus;
+    if (*plen > e->extent - off) {
+        *plen = e->extent - off;
+    }
+    if (!is_write) {
+        return e->host + off;
+    }
+    return cpu_physical_memory_map(e->phys + off, plen, 1);
+}
+
+static void bcm2835_dma_unmap(uint8_t *ptr, hwaddr len, int is_write,
+    hwaddr access_len)
+{
+    if (is_write) {
+        cpu_physical_memory_unmap(ptr, len, 1, access_len);
+    }
+}
+
+/* Slow path: move a single word through the MMIO dispatch, as the
+ * hardware would do it against a peripheral FIFO. Returns the number
+ * of bytes moved, 0 on bus error.
+ */
+static uint32_t bcm2835_dma_xfer_word(bcm2835_dma_state *s, int c,
+    uint32_t len)
+{
+    dmachan *ch = &s->chan[c];
+    dmatlbentry *se = NULL, *de = NULL;
+    hwaddr src = 0, dst = 0;
+    uint32_t data = 0;
+    uint32_t n = (len < 4) ? len : 4;
+    uint32_t i;
+
+    if (!(ch->ti & BCM2708_DMA_S_IGNORE)) {
+        se = bcm2835_dma_translate(s, c, ch->source_ad, 0);
+        if (!se) {
+            return 0;
+        }
+        src = se->phys + (ch->source_ad - se->bus);
+    }
+    if (!(ch->ti & BCM2708_DMA_D_IGNORE)) {
+        de = bcm2835_dma_translate(s, c, ch->dest_ad, 1);
+        if (!de) {
+            return 0;
+        }
+        dst = de->phys + (ch->dest_ad - de->bus);
+    }
+
+    if (n == 4) {
+        if (se) {
+            data = ldl_phys(src);
+        }
+        if (de) {
+            stl_phys(dst, data);
+        }
+    } else {
+        // Trailing bytes of a transfer length which is not word-aligned
+        for (i = 0; i < n; i++) {
             data = 0;
-            if (ch->ti & (1 << 11)) {
-                // Ignore reads
-            } else {
-                data = ldl_phys(ch->source_ad);
+            if (se) {
+                data = ldub_phys(src + i);
+            }
+            if (de) {
+                stb_phys(dst + i, data);
+            }
+        }
+    }
+    return n;
+}
+
+/* Move up to len bytes of the current control block, advancing the
+ * channel address registers. RAM ranges are mapped once per
+ * contiguous segment and moved with host memcpy/memset; everything else
+ * falls back to word accesses.
+ */
+static uint32_t bcm2835_dma_xfer(bcm2835_dma_state *s, int c, uint32_t len)
+{
+    dmachan *ch = &s->chan[c];
+    uint32_t ti = ch->ti;
+    uint32_t done = 0;
+    uint32_t n;
+    hwaddr slen, dlen;
+    uint8_t *src, *dst;
+    int src_bulk, dst_bulk;
+
+    while (len > 0) {
+        src = NULL;
+        dst = NULL;
+        slen = len;
+        dlen = len;
+
+        if (!(ti & BCM2708_DMA_S_IGNORE) && (ti & BCM2708_DMA_S_INC)) {
+            src = bcm2835_dma_map(s, ch->source_ad, &slen, 0);
+        }
+        if (!(ti & BCM2708_DMA_D_IGNORE) && (ti & BCM2708_DMA_D_INC)) {
+            dst = bcm2835_dma_map(s, ch->dest_ad, &dlen, 1);
+        }
+
+        // Reads from ignored or RAM sources have no side effects, so
+        // they can be batched; likewise for ignored or RAM destinations.
+        src_bulk = (ti & BCM2708_DMA_S_IGNORE) || src;
+        dst_bulk = (ti & BCM2708_DMA_D_IGNORE) || dst;
+
+        if (src_bulk && dst_bulk) {
+            n = len;
+            if (src && slen < n) {
+                n = slen;
             }
-            if (ch->ti & BCM2708_DMA_S_INC) {
-                ch->source_ad += 4;
+            if (dst && dlen < n) {
+                n = dlen;
             }
-            
-            if (ch->ti & (1 << 7)) {
-                // Ignore writes
-            } else {
-                stl_phys(ch->dest_ad, data);
+            if (dst) {
+                if (src) {
+                    memmove(dst, src, n);
+                } else {
+                    memset(dst, 0, n);
+                }
             }
-            if (ch->ti & BCM2708_DMA_D_INC) {
-                ch->dest_ad += 4;
+        } else {
+            n = 0;
+        }
+
+        if (src) {
+            bcm2835_dma_unmap(src, slen, 0, n);
+        }
+        if (dst) {
+            bcm2835_dma_unmap(dst, dlen, 1, n);
+        }
+
+        if (n == 0) {
+            n = bcm2835_dma_xfer_word(s, c, len);
+            if (n == 0) {
+                break;
             }
-            ch->txfr_len -= 4;
         }
-        ch->cs |= BCM2708_DMA_END;
-        if (ch->ti & BCM2708_DMA_INT_EN) {
-            ch->cs |= BCM2708_DMA_INT;
-            s->int_status |= (1 << c);
-            qemu_set_irq(ch->irq, 1);
+
+        if (ti & BCM2708_DMA_S_INC) {
+            ch->source_ad += n;
+        }
+        if (ti & BCM2708_DMA_D_INC) {
+            ch->dest_ad += n;
         }
-        
-        // Process next CB
-        ch->conblk_ad = ch->nextconbk;
+        len -= n;
+        done += n;
     }
-    ch->cs &= ~BCM2708_DMA_ACTIVE;
+    return done;
+}
+
+/* Run the current control block for at most budget bytes. Returns the
+ * number of bytes moved; the CB is complete once txfr_len reaches 0.
+ *
+ * In 2D mode txfr_len holds the remaining bytes of the current row in
+ * XLENGTH and the number of rows left after it in YLENGTH, so the CB
+ * moves YLENGTH + 1 rows of XLENGTH bytes. Each row is a single bulk
+ * move, followed by the signed source/destination strides.
+ */
+static uint32_t bcm2835_dma_run_cb(bcm2835_dma_state *s, int c,
+    uint32_t budget)
+{
+    dmachan *ch = &s->chan[c];
+    uint32_t done = 0;
+    uint32_t xrem, yrem, n;
+
+    if (!(ch->ti & BCM2708_DMA_TDMODE)) {
+        n = bcm2835_dma_xfer(s, c, MIN(budget, ch->txfr_len));
+        ch->txfr_len -= n;
+        return n;
+    }
+
+    while (budget > 0 && ch->txfr_len != 0 && ch->cb_loaded) {
+        xrem = ch->txfr_len & 0xffff;
+        yrem = (ch->txfr_len >> 16) & 0x3fff;
+
+        if (xrem != 0) {
+            n = bcm2835_dma_xfer(s, c, MIN(budget, xrem));
+            xrem -= n;
+            budget -= n;
+            done += n;
+        }
+        if (xrem == 0 && yrem != 0) {
+            // End of row: apply strides and reload XLENGTH
+            ch->source_ad += (int16_t)(ch->stride & 0xffff);
+            ch->dest_ad += (int16_t)(ch->stride >> 16);
+            yrem--;
+            xrem = ch->xlength;
+        }
+        ch->txfr_len = BCM2708_DMA_TDMODE_LEN(xrem, yrem);
+        if (ch->xlength == 0) {
+            // Degenerate CB, nothing to move in any row
+            ch->txfr_len = 0;
+        }
+    }
+    return done;
+}
+
+/* Load the CB at conblk_ad into the channel registers. Returns 0 and
+ * flags a bus error if conblk_ad does not decode.
+ */
+static int bcm2835_dma_fetch_cb(bcm2835_dma_state *s, int c)
+{
+    dmachan *ch = &s->chan[c];
+    dmacbentry *e;
+    dmatlbentry *te;
+    uint32_t off;
+    uint32_t cb[6];
+    int i;
+
+    e = &ch->cbcache[(ch->conblk_ad / BCM2708_DMA_CB_SIZE)
+        % BCM2708_DMA_CBCACHE_SIZE];
+
+    if (e->addr == ch->conblk_ad && e->addr != 0
+        && memcmp(e->host, e->cb, sizeof(e->cb)) == 0) {
+        ch->cbcache_hits++;
+        for (i = 0; i < 6; i++) {
+            cb[i] = le32_to_cpu(e->cb[i]);
+        }
+    } else {
+        ch->cbcache_misses++;
+        e->addr = 0;
+        te = bcm2835_dma_translate(s, c, ch->conblk_ad, 0);
+        if (!te) {
+            return 0;
+        }
+        off = ch->conblk_ad - te->bus;
+        if (te->host && te->extent >= off + BCM2708_DMA_CB_SIZE) {
+            memcpy(e->cb, te->host + off, sizeof(e->cb));
+            for (i = 0; i < 6; i++) {
+                cb[i] = le32_to_cpu(e->cb[i]);
+            }
+            e->addr = ch->conblk_ad;
+            e->host = te->host + off;
+        } else {
+            for (i = 0; i < 6; i++) {
+                cb[i] = ldl_phys(te->phys + off + 4 * i);
+            }
+        }
+    }
+
+    ch->ti = cb[0];
+    ch->source_ad = cb[1];
+    ch->dest_ad = cb[2];
+    ch->txfr_len = cb[3];
+    ch->stride = cb[4];
+    ch->nextconbk = cb[5];
+
+    ch->xlength = ch->txfr_len & 0xffff;
+    ch->cb_loaded = 1;
+
+    // Looping chains (audio rings and the like) never end on their own
+    if (ch->first_cb == 0) {
+        ch->first_cb = ch->conblk_ad;
+    } else if (ch->conblk_ad == ch->first_cb) {
+        ch->cyclic = 1;
+    }
+
+    ch->stats.cbs++;
+    if (ch->ti & BCM2708_DMA_S_IGNORE) {
+        ch->stats.fill_cbs++;
+    } else if (ch->ti & (BCM2708_DMA_S_DREQ | BCM2708_DMA_D_DREQ)) {
+        ch->stats.periph_cbs++;
+    } else {
+        ch->stats.copy_cbs++;
+    }
+    return 1;
+}
+
+static void bcm2835_dma_end_cb(bcm2835_dma_state *s, int c)
+{
+    dmachan *ch = &s->chan[c];
+
+    ch->cs |= BCM2708_DMA_END;
+    if (ch->ti & BCM2708_DMA_INT_EN) {
+        int64_t now = qemu_get_clock_ns(vm_clock);
+
+        ch->cs |= BCM2708_DMA_INT;
+        s->int_status |= (1 << c);
+        qemu_set_irq(ch->irq, 1);
+
+        bcm2835_hist_add(&ch->stats.latency, now - ch->active_ns);
+        ch->active_ns = now;
+    }
+
+    // Process next CB
+    ch->conblk_ad = ch->nextconbk;
+    ch->cb_loaded = 0;
+    if (ch->conblk_ad == 0) {
+        ch->cs &= ~BCM2708_DMA_ACTIVE;
+    }
+}
+
+/* Returns non-zero if the current CB is paced by a peripheral DREQ */
+static int bcm2835_dma_paced(dmachan *ch)
+{
+    return (ch->ti & (BCM2708_DMA_S_DREQ | BCM2708_DMA_D_DREQ))
+        && BCM2708_DMA_GET_PER_MAP(ch->ti) != 0;
+}
+
+static int bcm2835_dma_dreq_ok(bcm2835_dma_state *s, dmachan *ch)
+{
+    return !bcm2835_dma_paced(ch)
+        || (s->dreq & (1u << BCM2708_DMA_GET_PER_MAP(ch->ti)));
+}
+
+/* A channel held by its DREQ is not runnable; it gets kicked again when
+ * the peripheral raises the line.
+ */
+static int bcm2835_dma_runnable(bcm2835_dma_state *s, int c)
+{
+    dmachan *ch = &s->chan[c];
+
+    return (s->enable & (1 << c)) && (ch->cs & BCM2708_DMA_ACTIVE)
+        && !ch->offload_pending
+        && (!ch->cb_loaded || bcm2835_dma_dreq_ok(s, ch));
+}
+
+static void bcm2835_dma_kick(bcm2835_dma_state *s);
+
+/* Copy routine for the worker threads. Large copies go around the
+ * cache with non-temporal stores where available, since the data is
+ * unlikely to be touched again by this host CPU.
+ */
+static void bcm2835_dma_copy_large(uint8_t *dst, const uint8_t *src,
+    size_t len)
+{
+#ifdef __SSE2__
+    while (len > 0 && ((uintptr_t)dst & 15)) {
+        *dst++ = *src++;
+        len--;
+    }
+    while (len >= 64) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(src + 0));
+        __m128i b = _mm_loadu_si128((const __m128i *)(src + 16));
+        __m128i c = _mm_loadu_si128((const __m128i *)(src + 32));
+        __m128i d = _mm_loadu_si128((const __m128i *)(src + 48));
+        _mm_stream_si128((__m128i *)(dst + 0), a);
+        _mm_stream_si128((__m128i *)(dst + 16), b);
+        _mm_stream_si128((__m128i *)(dst + 32), c);
+        _mm_stream_si128((__m128i *)(dst + 48), d);
+        src += 64;
+        dst += 64;
+        len -= 64;
+    }
+    _mm_sfence();
+#endif
+    memcpy(dst, src, len);
+}
+
+static int bcm2835_dma_offload_worker(void *opaque)
+{
+    dmacopyjob *job = (dmacopyjob *)opaque;
+
+    bcm2835_dma_copy_large(job->dst, job->src, job->len);
+    return 0;
+}
+
+/* Runs in the main loop, under the global lock, once per job */
+static void bcm2835_dma_offload_done(void *opaque, int ret)
+{
+    dmacopyjob *job = (dmacopyjob *)opaque;
+    bcm2835_dma_state *s = (bcm2835_dma_state *)job->s;
+    dmachan *ch = &s->chan[job->chan];
+    uint32_t len = ch->offload_len;
+
+    if (--ch->offload_pending > 0) {
+        return;
+    }
+
+    // Unmapping marks the destination dirty and flushes translated code
+    bcm2835_dma_unmap(ch->offload_src, ch->offload_slen, 0, len);
+    bcm2835_dma_unmap(ch->offload_dst, ch->offload_dlen, 1, len);
+
+    if (!ch->offload_aborted) {
+        ch->stats.bytes += len;
+        ch->stats.offload_cbs++;
+        ch->source_ad += len;
+        ch->dest_ad += len;
+        ch->txfr_len -= len;
+        if (ch->txfr_len == 0) {
+            bcm2835_dma_end_cb(s, job->chan);
+        }
+    }
+    ch->offload_aborted = 0;
+    bcm2835_dma_kick(s);
+}
+
+/* Hand the rest of the current CB to the host thread pool if it is a
+ * large, plain RAM to RAM copy. Returns non-zero if it did; the channel
+ * is then not runnable until all jobs have completed.
+ */
+static int bcm2835_dma_offload(bcm2835_dma_state *s, int c)
+{
+    dmachan *ch = &s->chan[c];
+    uint32_t mask = BCM2708_DMA_TDMODE | BCM2708_DMA_S_IGNORE
+        | BCM2708_DMA_D_IGNORE | BCM2708_DMA_S_INC | BCM2708_DMA_D_INC;
+    uint8_t *src, *dst;
+    hwaddr slen, dlen;
+    uint32_t len, part, off;
+    int n, workers;
+
+    if (s->offload_threshold == 0 || ch->txfr_len < s->offload_threshold
+        || (ch->ti & mask) != (BCM2708_DMA_S_INC | BCM2708_DMA_D_INC)
+        || bcm2835_dma_paced(ch)) {
+        return 0;
+    }
+
+    slen = ch->txfr_len;
+    dlen = ch->txfr_len;
+    src = bcm2835_dma_map(s, ch->source_ad, &slen, 0);
+    dst = bcm2835_dma_map(s, ch->dest_ad, &dlen, 1);
+    len = MIN(slen, dlen);
+    if (!src || !dst || len < s->offload_threshold
+        || (src < dst + len && dst < src + len)) {
+        // Not worth it, or overlapping: leave it to the memmove path
+        if (src) {
+            bcm2835_dma_unmap(src, slen, 0, 0);
+        }
+        if (dst) {
+            bcm2835_dma_unmap(dst, dlen, 1, 0);
+        }
+        return 0;
+    }
+
+    ch->offload_src = src;
+    ch->offload_dst = dst;
+    ch->offload_slen = slen;
+    ch->offload_dlen = dlen;
+    ch->offload_len = len;
+    ch->offload_aborted = 0;
+
+    workers = MAX(1, MIN(s->offload_workers, BCM2708_DMA_MAX_WORKERS));
+    part = ((len / workers) + 0xfff) & ~0xfff;
+    ch->offload_pending = 0;
+    for (n = 0, off = 0; n < workers && off < len; n++, off += part) {
+        dmacopyjob *job = &ch->offload_job[n];
+        job->s = s;
+        job->chan = c;
+        job->src = src + off;
+        job->dst = dst + off;
+        job->len = MIN(part, len - off);
+        ch->offload_pending++;
+    }
+    for (n = 0; n < ch->offload_pending; n++) {
+        thread_pool_submit_aio(bcm2835_dma_offload_worker,
+            &ch->offload_job[n], bcm2835_dma_offload_done, &ch->offload_job[n]);
+    }
+    return 1;
+}
+
+/* Run channel c for at most budget bytes, crossing CB boundaries as
+ * needed. Every CB fetch is charged against the budget, so that chains
+ * of empty CBs looping onto themselves cannot stall the scheduler.
+ *
+ * Peripheral-paced CBs move one burst at a time, and only while the
+ * peripheral keeps its DREQ line asserted.
+ */
+static uint32_t bcm2835_dma_step(bcm2835_dma_state *s, int c, uint32_t budget)
+{
+    dmachan *ch = &s->chan[c];
+    uint32_t used = 0;
+    uint32_t chunk, n;
+
+    while (used < budget && bcm2835_dma_runnable(s, c)) {
+        if (!ch->cb_loaded) {
+            if (ch->conblk_ad == 0) {
+                ch->cs &= ~BCM2708_DMA_ACTIVE;
+                ch->first_cb = 0;
+                ch->cyclic = 0;
+                break;
+            }
+            used += BCM2708_DMA_CB_SIZE;
+            if (!bcm2835_dma_fetch_cb(s, c)) {
+                break;
+            }
+        }
+        if (used >= budget) {
+            break;
+        }
+        chunk = budget - used;
+        if (bcm2835_dma_paced(ch)) {
+            if (!bcm2835_dma_dreq_ok(s, ch)) {
+                ch->cs |= BCM2708_DMA_ISHELD;
+                break;
+            }
+            ch->cs &= ~BCM2708_DMA_ISHELD;
+            chunk = MIN(chunk, (BCM2708_DMA_GET_BURST(ch->ti) + 1) * 4);
+            // Wait cycles slow the channel down, charge them as bus time
+            used += BCM2708_DMA_GET_WAITS(ch->ti) * 4;
+        } else if (bcm2835_dma_offload(s, c)) {
+            break;
+        }
+        n = bcm2835_dma_run_cb(s, c, chunk);
+        ch->stats.bytes += n;
+        used += n;
+        if (ch->cb_loaded && ch->txfr_len == 0) {
+            bcm2835_dma_end_cb(s, c);
+        }
+    }
+    return used;
+}
+
+static void bcm2835_dma_kick(bcm2835_dma_state *s)
+{
+    if (s->bandwidth == 0) {
+        qemu_bh_schedule(s->bh);
+    } else if (!qemu_timer_pending(s->timer)) {
+        qemu_mod_timer(s->timer, qemu_get_clock_ns(vm_clock));
+    }
+}
+
+/* Returns non-zero if a runnable channel can only go on at the pace of
+ * something outside the guest CPU: a peripheral keeping its DREQ up, or
+ * a chain that loops forever. Running those back to back would just
+ * spin the host.
+ */
+static int bcm2835_dma_slow(dmachan *ch)
+{
+    return ch->cyclic || (ch->cb_loaded && bcm2835_dma_paced(ch));
+}
+
+/* One scheduler slice: give every runnable channel its byte budget,
+ * starting from a rotating channel so that none of them is favoured.
+ * With bandwidth modeling enabled, the next slice is delayed by the
+ * time the bus would have needed to move this slice's bytes. Without
+ * it, the next slice follows at once unless only paced or cyclic
+ * channels are left, which get one slice every backoff_us.
+ */
+static void bcm2835_dma_slice(void *opaque)
+{
+    bcm2835_dma_state *s = (bcm2835_dma_state *)opaque;
+    uint64_t moved = 0;
+    int pending = 0;
+    int fast = 0;
+    int i, c;
+
+    for (i = 0; i < 16; i++) {
+        c = (s->rr_next + i) & 0xf;
+        if (bcm2835_dma_runnable(s, c)) {
+            moved += bcm2835_dma_step(s, c, s->slice_bytes);
+            if (bcm2835_dma_runnable(s, c)) {
+                pending = 1;
+                fast |= !bcm2835_dma_slow(&s->chan[c]);
+            }
+        }
+    }
+    s->rr_next = (s->rr_next + 1) & 0xf;
+
+    if (!pending) {
+        return;
+    }
+    if (s->bandwidth == 0) {
+        if (fast || s->backoff_us == 0) {
+            qemu_bh_schedule(s->bh);
+        } else {
+            qemu_mod_timer(s->timer, qemu_get_clock_ns(vm_clock)
+                + (int64_t)s->backoff_us * 1000);
+        }
+    } else {
+        qemu_mod_timer(s->timer, qemu_get_clock_ns(vm_clock)
+            + muldiv64(moved, get_ticks_per_sec(), s->bandwidth));
+    }
+}
+
+static void bcm2835_dma_set_dreq(void *opaque, int n, int level)
+{
+    bcm2835_dma_state *s = (bcm2835_dma_state *)opaque;
+
+    if (n == 0) {
+        return;
+    }
+    if (level) {
+        s->dreq |= (1u << n);
+        bcm2835_dma_kick(s);
+    } else {
+        s->dreq &= ~(1u << n);
+    }
+}
+
+static void bcm2835_dma_reset_chan(bcm2835_dma_state *s, int c)
+{
+    dmachan *ch = &s->chan[c];
+
+    ch->cs = 0;
+    ch->conblk_ad = 0;
+    ch->ti = 0;
+    ch->source_ad = 0;
+    ch->dest_ad = 0;
+    ch->txfr_len = 0;
+    ch->stride = 0;
+    ch->nextconbk = 0;
+    ch->debug = 0;
+    ch->cb_loaded = 0;
+    ch->first_cb = 0;
+    ch->cyclic = 0;
+    if (ch->offload_pending) {
+        ch->offload_aborted = 1;
+    }
+
+    s->int_status &= ~(1 << c);
+    qemu_set_irq(ch->irq, 0);
 }
 
 static uint64_t bcm2835_dma_read(bcm2835_dma_state *s, hwaddr offset, 
@@ -136,6 +915,12 @@ static uint64_t bcm2835_dma_read(bcm2835_dma_state *s, hwaddr offset,
     switch(offset) {
     case 0x0:
         res = ch->cs;
+        if (!(res & BCM2708_DMA_ACTIVE)) {
+            res |= BCM2708_DMA_ISPAUSED;
+        }
+        if (s->dreq & (1u << BCM2708_DMA_GET_PER_MAP(ch->ti))) {
+            res |= BCM2708_DMA_DREQ;
+        }
         break;
     case 0x4:
         res = ch->conblk_ad;
@@ -174,15 +959,21 @@ static void bcm2835_dma_write(bcm2835_dma_state *s, hwaddr offset,
     uint64_t value, unsigned size, int c)
 {
     dmachan *ch = &s->chan[c];
-    uint32_t oldcs = ch->cs; 
+    uint32_t oldcs = ch->cs;
     
     switch(offset) {
     case 0x0:
         if (value & BCM2708_DMA_RESET) {
-            ch->cs |= BCM2708_DMA_RESET;
+            bcm2835_dma_reset_chan(s, c);
+            break;
         }
-        if (value & BCM2708_DMA_ABORT) {
-            ch->cs |= BCM2708_DMA_ABORT;
+        if ((value & BCM2708_DMA_ABORT) && ch->cb_loaded) {
+            // Drop the current CB, the next one is loaded if still active
+            ch->conblk_ad = ch->nextconbk;
+            ch->cb_loaded = 0;
+            if (ch->offload_pending) {
+                ch->offload_aborted = 1;
+            }
         }
         if (value & BCM2708_DMA_END) {
             ch->cs &= ~BCM2708_DMA_END;
@@ -192,14 +983,20 @@ static void bcm2835_dma_write(bcm2835_dma_state *s, hwaddr offset,
             s->int_status &= ~(1 << c);
             qemu_set_irq(ch->irq, 0);
         }
-        ch->cs &= ~0x30ff0001;
-        ch->cs |= (value & 0x30ff0001);
+        // Clearing ACTIVE pauses the channel, setting it again resumes
+        ch->cs &= ~BCM2708_DMA_CS_WMASK;
+        ch->cs |= (value & BCM2708_DMA_CS_WMASK);
         if (!(oldcs & BCM2708_DMA_ACTIVE) && (ch->cs & BCM2708_DMA_ACTIVE)) {
-            bcm2835_dma_update(s, c);
+            ch->active_ns = qemu_get_clock_ns(vm_clock);
+        }
+        if (bcm2835_dma_runnable(s, c)) {
+            bcm2835_dma_kick(s);
         }
         break;
     case 0x4:
         ch->conblk_ad = value;
+        ch->first_cb = 0;
+        ch->cyclic = 0;
         break;
     case 0x8:
         ch->ti = value;
@@ -220,7 +1017,11 @@ static void bcm2835_dma_write(bcm2835_dma_state *s, hwaddr offset,
         ch->nextconbk = value;
         break;
     case 0x20:
-        ch->debug = value;
+        // Error flags are write-1-to-clear, CS.ERR follows them
+        ch->debug &= ~(value & BCM2708_DMA_DEBUG_ERRORS);
+        if (!(ch->debug & BCM2708_DMA_DEBUG_ERRORS)) {
+            ch->cs &= ~BCM2708_DMA_ERR;
+        }
         break;
     default:
         qemu_log_mask(LOG_GUEST_ERROR,
@@ -261,6 +1062,7 @@ static void bcm2835_dma0_14_write(void *opaque, hwaddr offset,
     }
     if (offset == 0xff0) {
         s->enable = (value & 0xffff);
+        bcm2835_dma_kick(s);
         return;
     }
     bcm2835_dma_write( s, (offset & 0xff),
@@ -287,6 +1089,83 @@ static const MemoryRegionOps bcm2835_dma15_ops = {
     .endianness = DEVICE_NATIVE_ENDIAN,
 };
 
+static void bcm2835_dma_get_cbcache_hits(Object *obj, Visitor *v,
+    void *opaque, const char *name, Error **errp)
+{
+    bcm2835_dma_state *s = (bcm2835_dma_state *)opaque;
+    uint64_t value = 0;
+    int n;
+
+    for (n = 0; n < 16; n++) {
+        value += s->chan[n].cbcache_hits;
+    }
+    visit_type_uint64(v, &value, name, errp);
+}
+
+static void bcm2835_dma_get_cbcache_misses(Object *obj, Visitor *v,
+    void *opaque, const char *name, Error **errp)
+{
+    bcm2835_dma_state *s = (bcm2835_dma_state *)opaque;
+    uint64_t value = 0;
+    int n;
+
+    for (n = 0; n < 16; n++) {
+        value += s->chan[n].cbcache_misses;
+    }
+    visit_type_uint64(v, &value, name, errp);
+}
+
+static void bcm2835_dma_get_stats(Object *obj, Visitor *v,
+    void *opaque, const char *name, Error **errp)
+{
+    bcm2835_dma_state *s = (bcm2835_dma_state *)opaque;
+    dmastats *st;
+    char key[16];
+    int n;
+
+    visit_start_struct(v, NULL, NULL, name, 0, errp);
+    visit_type_uint64(v, &s->tlb_hits, "bus-tlb-hits", errp);
+    visit_type_uint64(v, &s->tlb_misses, "bus-tlb-misses", errp);
+    for (n = 0; n < 16; n++) {
+        st = &s->chan[n].stats;
+        snprintf(key, sizeof(key), "chan%d", n);
+        visit_start_struct(v, NULL, NULL, key, 0, errp);
+        visit_type_uint64(v, &st->cbs, "cbs", errp);
+        visit_type_uint64(v, &st->bytes, "bytes", errp);
+        visit_type_uint64(v, &st->fill_cbs, "fill-cbs", errp);
+        visit_type_uint64(v, &st->copy_cbs, "copy-cbs", errp);
+        visit_type_uint64(v, &st->periph_cbs, "periph-cbs", errp);
+        visit_type_uint64(v, &st->offload_cbs, "offload-cbs", errp);
+        visit_type_uint64(v, &s->chan[n].cbcache_hits, "cb-cache-hits", errp);
+        visit_type_uint64(v, &s->chan[n].cbcache_misses, "cb-cache-misses",
+            errp);
+        bcm2835_visit_hist(v, &st->latency, "int-latency-ns", errp);
+        visit_end_struct(v, errp);
+    }
+    visit_end_struct(v, errp);
+}
+
+/* Writing true to stats-reset clears all counters */
+static void bcm2835_dma_set_stats_reset(Object *obj, Visitor *v,
+    void *opaque, const char *name, Error **errp)
+{
+    bcm2835_dma_state *s = (bcm2835_dma_state *)opaque;
+    bool value = false;
+    int n;
+
+    visit_type_bool(v, &value, name, errp);
+    if (!value) {
+        return;
+    }
+    s->tlb_hits = 0;
+    s->tlb_misses = 0;
+    for (n = 0; n < 16; n++) {
+        memset(&s->chan[n].stats, 0, sizeof(dmastats));
+        s->chan[n].cbcache_hits = 0;
+        s->chan[n].cbcache_misses = 0;
+    }
+}
+
 static const VMStateDescription vmstate_bcm2835_dma = {
     .name = "bcm2835_dma",
     .version_id = 1,
@@ -304,11 +1183,33 @@ static int bcm2835_dma_init(SysBusDevice *dev)
     
     s->enable = 0xffff;
     s->int_status = 0;
+    s->dreq = 1;
+    bcm2835_dma_tlb_flush(s);
+    s->tlb_hits = 0;
+    s->tlb_misses = 0;
     for(n = 0; n < 16; n++) {
         s->chan[n].cs = 0;
         s->chan[n].conblk_ad = 0;
+        s->chan[n].cb_loaded = 0;
+        s->chan[n].first_cb = 0;
+        s->chan[n].cyclic = 0;
+        s->chan[n].offload_pending = 0;
+        s->chan[n].offload_aborted = 0;
+        memset(&s->chan[n].stats, 0, sizeof(dmastats));
+        s->chan[n].active_ns = 0;
         sysbus_init_irq(dev, &s->chan[n].irq);
     }
+
+    // Keep slices word-aligned so FIFO accesses are never split
+    s->slice_bytes = (s->slice_bytes + 3) & ~3;
+    if (s->slice_bytes == 0) {
+        s->slice_bytes = 4;
+    }
+    s->rr_next = 0;
+    s->bh = qemu_bh_new(bcm2835_dma_slice, s);
+    s->timer = qemu_new_timer_ns(vm_clock, bcm2835_dma_slice, s);
+
+    qdev_init_gpio_in(&dev->qdev, bcm2835_dma_set_dreq, DREQ_COUNT);
     
     memory_region_init_io(&s->iomem0_14, &bcm2835_dma0_14_ops, s, 
         "bcm2835_dma0_14", 0xf00);
@@ -316,17 +1217,40 @@ static int bcm2835_dma_init(SysBusDevice *dev)
     memory_region_init_io(&s->iomem15, &bcm2835_dma15_ops, s, 
         "bcm2835_dma15", 0x100);
     sysbus_init_mmio(dev, &s->iomem15);
+
+    // Read-only CB cache counters, e.g. for qom-get
+    object_property_add(OBJECT(dev), "cb-cache-hits", "uint64",
+        bcm2835_dma_get_cbcache_hits, NULL, NULL, s, NULL);
+    object_property_add(OBJECT(dev), "cb-cache-misses", "uint64",
+        bcm2835_dma_get_cbcache_misses, NULL, NULL, s, NULL);
+    object_property_add(OBJECT(dev), "stats", "bcm2835-dma-stats",
+        bcm2835_dma_get_stats, NULL, NULL, s, NULL);
+    object_property_add(OBJECT(dev), "stats-reset", "bool",
+        NULL, bcm2835_dma_set_stats_reset, NULL, s, NULL);
     
     vmstate_register(&dev->qdev, -1, &vmstate_bcm2835_dma, s);
 
     return 0;
 }
 
+static Property bcm2835_dma_properties[] = {
+    DEFINE_PROP_UINT32("slice-bytes", bcm2835_dma_state, slice_bytes, 16384),
+    DEFINE_PROP_UINT32("bandwidth", bcm2835_dma_state, bandwidth, 0),
+    DEFINE_PROP_UINT32("backoff-us", bcm2835_dma_state, backoff_us, 1000),
+    DEFINE_PROP_UINT32("offload-threshold", bcm2835_dma_state,
+        offload_threshold, 1 << 20),
+    DEFINE_PROP_UINT32("offload-workers", bcm2835_dma_state,
+        offload_workers, 4),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
 static void bcm2835_dma_class_init(ObjectClass *klass, void *data)
 {
+    DeviceClass *dc = DEVICE_CLASS(klass);
     SysBusDeviceClass *sdc = SYS_BUS_DEVICE_CLASS(klass);
 
     sdc->init = bcm2835_dma_init;
+    dc->props = bcm2835_dma_properties;
 }
 
 static TypeInfo bcm2835_dma_info = {
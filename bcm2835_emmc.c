@@ -7,7 +7,15 @@
 #include "qemu-common.h"
 #include "qdev.h"
 #include "sysemu/blockdev.h"
+#include "block/block.h"
 #include "sd.h"
+#include "exec/cpu-common.h"
+#include "qapi/visitor.h"
+#include "qemu/timer.h"
+#include "qemu/bitmap.h"
+#include "sysemu/sysemu.h"
+#include "bcm2835_stats.h"
+#include "trace.h"
 
 /*
  * Controller registers
@@ -212,127 +220,2161 @@
 
 #define SDHCI_ADMA_ADDRESS  0x58
 
+/* ADMA2 descriptor attributes */
+#define  SDHCI_ADMA_VALID       0x01
+#define  SDHCI_ADMA_END         0x02
+#define  SDHCI_ADMA_INT         0x04
+#define  SDHCI_ADMA_ACT_MASK    0x30
+#define   SDHCI_ADMA_ACT_NOP    0x00
+#define   SDHCI_ADMA_ACT_TRAN   0x20
+#define   SDHCI_ADMA_ACT_LINK   0x30
+#define  SDHCI_ADMA_DESC_SIZE   8
+#define  SDHCI_ADMA_MAX_DESC    65536   /* guard against descriptor loops */
+
+/* ADMA error states, as reported in SDHCI_ADMA_ERROR */
+#define  SDHCI_ADMA_ERR_ST_FDS  0x01
+#define  SDHCI_ADMA_ERR_ST_TFR  0x03
+#define  SDHCI_ADMA_ERR_LEN     0x04
+
 /* 60-FB reserved */
 
-#define SDHCI_SLOT_INT_STATUS   0xFC
+#define SDHCI_SLOT_INT_STATUS   0xFC
+
+#define SDHCI_HOST_VERSION  0xFE
+#define  SDHCI_VENDOR_VER_MASK  0xFF00
+#define  SDHCI_VENDOR_VER_SHIFT 8
+#define  SDHCI_SPEC_VER_MASK    0x00FF
+#define  SDHCI_SPEC_VER_SHIFT   0
+#define   SDHCI_SPEC_100    0
+#define   SDHCI_SPEC_200    1
+#define   SDHCI_SPEC_300    2
+
+/*
+ * End of controller registers.
+ */
+#define MMC_VDD_165_195     0x00000080  /* VDD voltage 1.65 - 1.95 */
+#define MMC_VDD_20_21       0x00000100  /* VDD voltage 2.0 ~ 2.1 */
+#define MMC_VDD_21_22       0x00000200  /* VDD voltage 2.1 ~ 2.2 */
+#define MMC_VDD_22_23       0x00000400  /* VDD voltage 2.2 ~ 2.3 */
+#define MMC_VDD_23_24       0x00000800  /* VDD voltage 2.3 ~ 2.4 */
+#define MMC_VDD_24_25       0x00001000  /* VDD voltage 2.4 ~ 2.5 */
+#define MMC_VDD_25_26       0x00002000  /* VDD voltage 2.5 ~ 2.6 */
+#define MMC_VDD_26_27       0x00004000  /* VDD voltage 2.6 ~ 2.7 */
+#define MMC_VDD_27_28       0x00008000  /* VDD voltage 2.7 ~ 2.8 */
+#define MMC_VDD_28_29       0x00010000  /* VDD voltage 2.8 ~ 2.9 */
+#define MMC_VDD_29_30       0x00020000  /* VDD voltage 2.9 ~ 3.0 */
+#define MMC_VDD_30_31       0x00040000  /* VDD voltage 3.0 ~ 3.1 */
+#define MMC_VDD_31_32       0x00080000  /* VDD voltage 3.1 ~ 3.2 */
+#define MMC_VDD_32_33       0x00100000  /* VDD voltage 3.2 ~ 3.3 */
+#define MMC_VDD_33_34       0x00200000  /* VDD voltage 3.3 ~ 3.4 */
+#define MMC_VDD_34_35       0x00400000  /* VDD voltage 3.4 ~ 3.5 */
+#define MMC_VDD_35_36       0x00800000  /* VDD voltage 3.5 ~ 3.6 */
+
+#define MMC_CAP_4_BIT_DATA  (1 << 0)    /* Can the host do 4 bit transfers */
+#define MMC_CAP_MMC_HIGHSPEED   (1 << 1)    /* Can do MMC high-speed timing */
+#define MMC_CAP_SD_HIGHSPEED    (1 << 2)    /* Can do SD high-speed timing */
+#define MMC_CAP_SDIO_IRQ    (1 << 3)    /* Can signal pending SDIO IRQs */
+#define MMC_CAP_SPI     (1 << 4)    /* Talks only SPI protocols */
+#define MMC_CAP_NEEDS_POLL  (1 << 5)    /* Needs polling for card-detection */
+#define MMC_CAP_8_BIT_DATA  (1 << 6)    /* Can the host do 8 bit transfers */
+#define MMC_CAP_DISABLE     (1 << 7)    /* Can the host be disabled */
+#define MMC_CAP_NONREMOVABLE    (1 << 8)    /* Nonremovable e.g. eMMC */
+#define MMC_CAP_WAIT_WHILE_BUSY (1 << 9)    /* Waits while card is busy */
+#define MMC_CAP_ERASE       (1 << 10)   /* Allow erase/trim commands */
+#define MMC_CAP_1_8V_DDR    (1 << 11)   /* can support */
+                        /* DDR mode at 1.8V */
+#define MMC_CAP_1_2V_DDR    (1 << 12)   /* can support */
+                        /* DDR mode at 1.2V */
+#define MMC_CAP_POWER_OFF_CARD  (1 << 13)   /* Can power off after boot */
+#define MMC_CAP_BUS_WIDTH_TEST  (1 << 14)   /* CMD14/CMD19 bus width ok */
+#define MMC_CAP_UHS_SDR12   (1 << 15)   /* Host supports UHS SDR12 mode */
+#define MMC_CAP_UHS_SDR25   (1 << 16)   /* Host supports UHS SDR25 mode */
+#define MMC_CAP_UHS_SDR50   (1 << 17)   /* Host supports UHS SDR50 mode */
+#define MMC_CAP_UHS_SDR104  (1 << 18)   /* Host supports UHS SDR104 mode */
+#define MMC_CAP_UHS_DDR50   (1 << 19)   /* Host supports UHS DDR50 mode */
+#define MMC_CAP_SET_XPC_330 (1 << 20)   /* Host supports >150mA current at 3.3V */
+#define MMC_CAP_SET_XPC_300 (1 << 21)   /* Host supports >150mA current at 3.0V */
+#define MMC_CAP_SET_XPC_180 (1 << 22)   /* Host supports >150mA current at 1.8V */
+#define MMC_CAP_DRIVER_TYPE_A   (1 << 23)   /* Host supports Driver Type A */
+#define MMC_CAP_DRIVER_TYPE_C   (1 << 24)   /* Host supports Driver Type C */
+#define MMC_CAP_DRIVER_TYPE_D   (1 << 25)   /* Host supports Driver Type D */
+#define MMC_CAP_MAX_CURRENT_200 (1 << 26)   /* Host max current limit is 200mA */
+#define MMC_CAP_MAX_CURRENT_400 (1 << 27)   /* Host max current limit is 400mA */
+#define MMC_CAP_MAX_CURRENT_600 (1 << 28)   /* Host max current limit is 600mA */
+#define MMC_CAP_MAX_CURRENT_800 (1 << 29)   /* Host max current limit is 800mA */
+#define MMC_CAP_CMD23       (1 << 30)   /* CMD23 supported. */
+#define MMC_CAP_HW_RESET    (1 << 31)   /* Hardware reset */
+
+
+#define MMC_CAP2_BOOTPART_NOACC (1 << 0)    /* Boot partition no access */
+#define MMC_CAP2_CACHE_CTRL (1 << 1)    /* Allow cache control */
+#define MMC_CAP2_POWEROFF_NOTIFY (1 << 2)   /* Notify poweroff supported */
+#define MMC_CAP2_NO_MULTI_READ  (1 << 3)    /* Multiblock reads don't work */
+#define MMC_CAP2_FORCE_MULTIBLOCK (1 << 4)  /* Always use multiblock transfers */
+
+/*
+ * Block data path
+ */
+
+#define BLK_SIZE            512
+#define BLK_BUF_BLOCKS      64      /* blocks per block-layer request */
+#define BLK_BUF_SIZE        (BLK_SIZE * BLK_BUF_BLOCKS)
+
+#define RA_WINDOWS          2       /* one being read, one loading */
+
+#define RAM_CHUNK_SECTORS   8       /* dirty tracking granularity */
+#define RAM_FLUSH_CHUNKS    256     /* largest write-back request */
+#define RAM_LOAD_SECTORS    2048
+
+#define ZERO_CHUNK_SECTORS  128     /* zero map granularity, 64K */
+#define ZERO_SCAN_SECTORS   (1 << 21)   /* largest block status query */
+#define ERASE_ZERO_SECTORS  2048    /* largest zero write of an erase */
+
+#define PROF_MAGIC          "BCMPROF2"
+#define PROF_CHUNK_SECTORS  128     /* boot cache granularity, 64K */
+#define PROF_RUN_CHUNKS     16      /* largest prefetch request */
+#define PROF_INFLIGHT       4       /* prefetch requests at a time */
+#define PROF_MAX_EXTENTS    65536
+#define PROF_HASH_SECTORS   2048    /* profile data checked against image */
+#define PROF_SAMPLE         1024    /* fills before judging the hit rate */
+
+#define EMMC_CLOCK          50000000    /* controller base clock */
+#define THROTTLE_BURST_NS   100000000   /* budget that can pile up */
+
+#define SD_R1_STATE(r)      (((r) >> 9) & 0xf)
+#define SD_STATE_TRAN       4
+#define SD_OCR_BUSY         (1u << 31)
+#define SD_OCR_CCS          (1u << 30)
+#define SD_ACMD(c)          (0x40 | (c))
+#define SD_SCR_CMD23        0x02    /* SCR byte 3, CMD_SUPPORT */
+#define SD_R1_ERASE_SEQ_ERROR   (1u << 28)
+#define SD_R1_ERASE_PARAM   (1u << 27)
+#define SD_R1_WP_ERASE_SKIP (1u << 15)
+
+/* Erase parameters in the SD status (ACMD13): 4MB allocation units,
+ * erased 16 at a time in 1s.
+ */
+#define SD_SSR_AU_SIZE      9
+#define SD_SSR_ERASE_SIZE   16
+#define SD_SSR_ERASE_TIMEOUT 1
+
+
+/* Latency classes */
+#define LAT_READ            0
+#define LAT_WRITE           1
+#define LAT_OTHER           2
+#define LAT_CLASSES         3
+
+typedef struct {
+    uint64_t cmds[64];
+    uint64_t acmds[64];
+    uint64_t blocks_read;
+    uint64_t blocks_written;
+    uint64_t port_reads;    /* data port accesses */
+    uint64_t port_writes;
+    uint64_t irqs;          /* interrupt line assertions */
+    uint64_t zero_blocks;   /* blocks read from the zero map */
+    uint64_t prof_hits;     /* FIFO fills served from the boot cache */
+    uint64_t prof_misses;
+    bcm2835_hist latency[LAT_CLASSES];  /* host ns, command to completion */
+} emmcstats;
+
+/* Read-ahead window, blocks loaded ahead of a sequential reader */
+typedef struct {
+    void *emmc;
+    uint8_t *buf;
+    int64_t sector;
+    uint32_t count;         /* blocks held or loading, 0 if empty */
+    int stale;              /* overwritten while loading */
+    BlockDriverAIOCB *aiocb;
+    struct iovec iov;
+    QEMUIOVector qiov;
+} bcm2835_emmc_ra;
+
+/* Blocks read by a boot, in the order the guest first wanted them */
+typedef struct {
+    uint64_t sector;
+    uint32_t count;
+    uint32_t pad;
+} bcm2835_emmc_extent;
+
+/* Boot profile file header, little endian, followed by the extents */
+typedef struct {
+    char magic[8];
+    uint64_t sectors;       /* image size */
+    uint64_t hash;          /* of the image data the profile starts with */
+    uint32_t count;
+    uint32_t hashed;        /* blocks of the extents in the hash */
+} bcm2835_emmc_prof_hdr;
+
+/* Prefetch request for a run of consecutive boot cache chunks */
+typedef struct {
+    void *emmc;
+    uint8_t *buf;
+    uint32_t chunk;
+    uint32_t count;
+    int stale;              /* overwritten while loading */
+    struct iovec iov;
+    QEMUIOVector qiov;
+} bcm2835_emmc_prof_run;
+
+typedef struct {
+    SysBusDevice busdev;
+    MemoryRegion iomem;
+
+    SDState *card;
+    BlockDriverState *bdrv;
+    uint32_t drive_index;
+
+    uint32_t arg2;
+    uint32_t blksizecnt;
+    uint32_t arg1;
+    uint32_t cmdtm;
+    uint32_t resp0;
+    uint32_t resp1;
+    uint32_t resp2;
+    uint32_t resp3;
+    uint32_t data;
+    uint32_t status;
+    uint32_t control0;
+    uint32_t control1;
+    uint32_t interrupt;
+    uint32_t irpt_mask;
+    uint32_t irpt_en;
+    uint32_t control2;
+    uint32_t force_irpt;
+    uint32_t spi_int_spt;
+    uint32_t slotisr_ver;
+    uint32_t caps;
+    uint32_t caps2;
+    uint32_t maxcurr;
+    uint32_t maxcurr2;
+    
+    uint32_t adma_err;
+    uint32_t adma_addr;
+    uint32_t adma_attr;     /* descriptor being worked on */
+    uint32_t adma_cur;
+    uint32_t adma_len;
+    int adma_count;
+    
+    int acmd;
+    int write_op;
+    uint32_t data_count;
+    uint32_t data_total;    /* bytes before an automatic stop */
+    uint8_t data_cmd;       /* command of the data phase, SD_ACMD() if app */
+
+    /* Pre-defined block counts */
+    uint32_t blk_preset;    /* from CMD23, for the next command */
+    uint32_t cmd_preset;    /* block count of the current command, or 0 */
+    int stop_pending;       /* the controller stops the card, not the guest */
+
+    /* Throttling, each bucket is the time its next request may go at */
+    uint32_t thr_bps;
+    uint32_t thr_iops;
+    uint32_t thr_follow_clock;  /* also limit to the programmed SD clock */
+    int64_t thr_bps_next;
+    int64_t thr_iops_next;
+    int throttled;          /* data phase waits for thr_timer */
+    int thr_flush_pending;  /* with written blocks to commit */
+    QEMUTimer *thr_timer;
+
+    /* Erase range from CMD32/CMD33, in blocks, -1 if unset */
+    int64_t erase_start;
+    int64_t erase_end;
+
+    /* DMA data phase */
+    uint32_t blksize;
+    uint32_t blocks_left;   /* blocks still to move for the command */
+    int dma_paused;         /* SDMA stopped at a buffer boundary */
+    uint8_t *fifo;          /* blocks between card and guest */
+    uint32_t fifo_pos;
+    uint32_t fifo_len;
+
+    /* Block data path: CMD17/18/24/25 served straight from the image */
+    uint32_t rca;           /* snooped from the CMD3 response */
+    int card_hc;            /* block addressed card, from the ACMD41 OCR */
+    int blk_active;         /* the controller owns the data phase */
+    int blk_read;
+    int blk_stop;           /* multi-block command waiting for CMD12 */
+    int64_t blk_sector;     /* next sector to fetch from or commit to */
+    int64_t blk_sectors;    /* card size */
+    uint32_t blk_pos;       /* bytes through the current block */
+
+    /* Block layer request filling or draining the FIFO */
+    BlockDriverAIOCB *aiocb;
+    int aio_cancel;
+    uint32_t aio_blocks;
+    struct iovec iov;
+    QEMUIOVector qiov;
+
+    /* Sequential read-ahead */
+    uint32_t ra_blocks;     /* window size, in blocks */
+    uint32_t ra_max_bytes;  /* memory cap for all windows */
+    uint32_t ra_window;     /* window size in use, 0 if disabled */
+    bcm2835_emmc_ra ra[RA_WINDOWS];
+    bcm2835_emmc_ra *ra_wait;   /* window a FIFO fill waits for */
+    int64_t ra_next;        /* where a sequential reader goes next */
+    uint64_t ra_hits;
+    uint64_t ra_misses;
+
+    /* Chunks nothing in the image chain holds data for, read as zeros */
+    uint32_t zero_map_enable;
+    unsigned long *zero_map;
+    int64_t zero_chunks;
+    int64_t zero_sectors;
+    BlockDriverAIOCB *discard_acb;
+    int64_t discard_sector; /* discard in flight */
+    int64_t discard_nb;
+    int64_t erase_next;     /* first block not known to read as zeros */
+    uint8_t *erase_zeros;
+    struct iovec erase_iov;
+    QEMUIOVector erase_qiov;
+
+    /* Boot profile: the blocks a boot reads are recorded to prof_path,
+     * and prefetched into the boot cache when the next boot starts.
+     */
+    char *prof_path;
+    uint32_t prof_seconds;  /* how long a boot is recorded and replayed */
+    uint32_t prof_max_bytes;    /* memory cap for the boot cache */
+    int64_t prof_sectors;
+    int prof_recording;
+    uint64_t prof_hash;     /* of the data recorded so far, as first read */
+    uint32_t prof_hashed;   /* blocks of the extents in the hash */
+    int prof_hash_end;      /* a recorded fill never landed, stop there */
+    int64_t prof_fill_pos;  /* of the FIFO data in the extents, or -1 */
+    bcm2835_emmc_extent *prof_rec;
+    uint32_t prof_nrec;
+    uint64_t prof_rec_blocks;   /* in all the extents */
+    uint32_t prof_rec_alloc;
+    uint32_t *prof_chunks;  /* chunks to prefetch, in boot order */
+    uint32_t prof_nchunks;
+    uint32_t prof_next;
+    uint64_t prof_bytes;    /* cached or loading */
+    GHashTable *prof_cache; /* chunk -> data, NULL once the replay is over */
+    GSList *prof_runs;      /* prefetch requests in flight */
+    GSList *prof_bufs;
+    QEMUTimer *prof_timer;
+
+    /* Whole image held in host memory */
+    uint32_t ram_image;
+    uint32_t ram_writeback; /* 0 to keep writes in memory only */
+    uint32_t ram_flush_ms;  /* write-back delay */
+    uint8_t *ram;
+    unsigned long *ram_dirty;   /* RAM_CHUNK_SECTORS blocks per bit */
+    int64_t ram_chunks;
+    int64_t ram_cursor;     /* where the next write-back looks from */
+    int ram_flushing;
+    QEMUTimer *ram_timer;
+    struct iovec ram_iov;
+    QEMUIOVector ram_qiov;
+        
+    qemu_irq irq;
+    qemu_irq dreq;
+    int irq_level;
+
+    emmcstats stats;
+    int64_t lat_start;      /* rt_clock ns the command was issued, or 0 */
+    int lat_class;
+    int lat_wait;           /* completes with DATA_END, not the response */
+    
+} bcm2835_emmc_state;
+
+static void bcm2835_emmc_lat_end(bcm2835_emmc_state *s)
+{
+    int64_t ns = qemu_get_clock_ns(rt_clock) - s->lat_start;
+
+    bcm2835_hist_add(&s->stats.latency[s->lat_class], ns);
+    trace_bcm2835_emmc_cmd_done(s, s->data_cmd & 0x3f,
+        (s->data_cmd & SD_ACMD(0)) != 0, s->lat_class, ns);
+    s->lat_start = 0;
+}
+
+static void bcm2835_emmc_set_irq(bcm2835_emmc_state *s) 
+{
+    int level = (s->irpt_en & s->irpt_mask & s->interrupt) != 0;
+
+    if (s->lat_start && s->lat_wait
+        && (s->interrupt & (SDHCI_INT_DATA_END | SDHCI_INT_ERROR))) {
+        bcm2835_emmc_lat_end(s);
+    }
+    if (level && !s->irq_level) {
+        s->stats.irqs++;
+        trace_bcm2835_emmc_irq(s, s->interrupt);
+    }
+    s->irq_level = level;
+    if (level) {
+        qemu_set_irq(s->irq, 1);
+    } else {
+        qemu_set_irq(s->irq, 0);
+    }
+}
+
+/* Is the data phase waiting for the block layer? */
+static int bcm2835_emmc_busy(bcm2835_emmc_state *s)
+{
+    return s->aiocb != NULL || s->ra_wait != NULL || s->throttled;
+}
+
+/* Is there data waiting to be read from the data port? */
+static int bcm2835_emmc_data_ready(bcm2835_emmc_state *s)
+{
+    if (s->blk_active) {
+        return s->blk_read && s->fifo_pos < s->fifo_len;
+    }
+    return sd_data_ready(s->card);
+}
+
+/* Keep the DMA request line asserted while the data port can be read
+ * (card sending data) or written (write command in progress).
+ */
+static void bcm2835_emmc_update_dreq(bcm2835_emmc_state *s)
+{
+    if (s->cmdtm & SDHCI_TRNS_DMA) {
+        // The controller's own DMA engine feeds the data port
+        qemu_set_irq(s->dreq, 0);
+    } else if (s->blk_active) {
+        qemu_set_irq(s->dreq, s->blocks_left > 0 && !bcm2835_emmc_busy(s)
+            && (!s->blk_read || s->fifo_pos < s->fifo_len));
+    } else if (s->write_op || sd_data_ready(s->card)) {
+        qemu_set_irq(s->dreq, 1);
+    } else {
+        qemu_set_irq(s->dreq, 0);
+    }
+}
+
+static void bcm2835_emmc_data_resume(bcm2835_emmc_state *s);
+static void bcm2835_emmc_fifo_fill(bcm2835_emmc_state *s);
+static void bcm2835_emmc_fifo_flush(bcm2835_emmc_state *s);
+static void bcm2835_emmc_fifo_commit(bcm2835_emmc_state *s);
+
+/* Bytes per second the bus allows at the clock and width the guest
+ * programmed, 0 while the card clock is off.
+ */
+static uint64_t bcm2835_emmc_bus_rate(bcm2835_emmc_state *s)
+{
+    uint32_t div, width;
+    uint64_t clock;
+
+    if (!(s->control1 & SDHCI_CLOCK_CARD_EN)) {
+        return 0;
+    }
+    div = ((s->control1 >> SDHCI_DIVIDER_SHIFT) & SDHCI_DIV_MASK)
+        | (((s->control1 >> SDHCI_DIVIDER_HI_SHIFT) & 0x3)
+            << SDHCI_DIV_MASK_LEN);
+    clock = div ? EMMC_CLOCK / (2 * div) : EMMC_CLOCK;
+    if (s->control0 & SDHCI_CTRL_8BITBUS) {
+        width = 8;
+    } else if (s->control0 & SDHCI_CTRL_4BITBUS) {
+        width = 4;
+    } else {
+        width = 1;
+    }
+    return clock * width / 8;
+}
+
+/* Charge a command to the IOPS bucket. Past its budget, the command
+ * still gets its response but the data phase waits.
+ */
+static void bcm2835_emmc_throttle_cmd(bcm2835_emmc_state *s)
+{
+    int64_t now;
+
+    if (s->thr_iops == 0) {
+        return;
+    }
+    now = qemu_get_clock_ns(vm_clock);
+    s->thr_iops_next = MAX(s->thr_iops_next, now - THROTTLE_BURST_NS);
+    if (s->thr_iops_next > now) {
+        s->throttled = 1;
+        qemu_mod_timer(s->thr_timer, s->thr_iops_next);
+    }
+    s->thr_iops_next += get_ticks_per_sec() / s->thr_iops;
+}
+
+/* Check len bytes against the bandwidth bucket before they move.
+ * Returns 1 if the data phase has to wait for the throttle timer.
+ */
+static int bcm2835_emmc_throttle_bytes(bcm2835_emmc_state *s, uint32_t len)
+{
+    uint64_t rate = s->thr_bps;
+    uint64_t bus;
+    int64_t now;
+
+    if (s->thr_follow_clock) {
+        bus = bcm2835_emmc_bus_rate(s);
+        if (bus && (!rate || bus < rate)) {
+            rate = bus;
+        }
+    }
+    if (rate == 0) {
+        return 0;
+    }
+    now = qemu_get_clock_ns(vm_clock);
+    s->thr_bps_next = MAX(s->thr_bps_next, now - THROTTLE_BURST_NS);
+    if (s->thr_bps_next > now) {
+        s->throttled = 1;
+        qemu_mod_timer(s->thr_timer, s->thr_bps_next);
+        return 1;
+    }
+    s->thr_bps_next += muldiv64(len, get_ticks_per_sec(), rate);
+    return 0;
+}
+
+static void bcm2835_emmc_throttle_tick(void *opaque)
+{
+    bcm2835_emmc_state *s = (bcm2835_emmc_state *)opaque;
+
+    s->throttled = 0;
+    if (s->thr_flush_pending) {
+        s->thr_flush_pending = 0;
+        bcm2835_emmc_fifo_flush(s);
+        if (bcm2835_emmc_busy(s)) {
+            return;
+        }
+    }
+    bcm2835_emmc_data_resume(s);
+}
+
+/* Mark the chunks between sector and end that the image chain has no
+ * data for. A chunk counts only if it is unallocated all through, in
+ * however many pieces block status reports it.
+ */
+static void bcm2835_emmc_zero_scan(bcm2835_emmc_state *s, int64_t sector,
+    int64_t end)
+{
+    int64_t run = -1;
+    int64_t first, last;
+    int ret, pnum;
+
+    while (sector < end) {
+        ret = bdrv_is_allocated_above(s->bdrv, NULL, sector,
+            MIN(end - sector, ZERO_SCAN_SECTORS), &pnum);
+        if (ret < 0 || pnum <= 0) {
+            break;
+        }
+        if (ret == 0 && run < 0) {
+            run = sector;
+        }
+        sector += pnum;
+        if (run >= 0 && (ret != 0 || sector >= end)) {
+            first = DIV_ROUND_UP(run, ZERO_CHUNK_SECTORS);
+            last = (ret != 0 ? sector - pnum : sector) / ZERO_CHUNK_SECTORS;
+            if (ret == 0 && sector == s->zero_sectors) {
+                // The image may end partway through its last chunk
+                last = s->zero_chunks;
+            }
+            if (last > first) {
+                bitmap_set(s->zero_map, first, last - first);
+            }
+            run = -1;
+        }
+    }
+}
+
+/* Forget that the chunks overlapping nb blocks at sector are zeros */
+static void bcm2835_emmc_zero_clear(bcm2835_emmc_state *s, int64_t sector,
+    int64_t nb)
+{
+    int64_t first, last;
+
+    if (!s->zero_map) {
+        return;
+    }
+    first = sector / ZERO_CHUNK_SECTORS;
+    last = MIN((sector + nb - 1) / ZERO_CHUNK_SECTORS, s->zero_chunks - 1);
+    if (nb <= 0 || first > last) {
+        return;
+    }
+    bitmap_clear(s->zero_map, first, last - first + 1);
+}
+
+/* Serve a FIFO fill of up to nb blocks without reading the image if
+ * they are in chunks known to be zeros. Returns 1 if the FIFO was
+ * filled.
+ */
+static int bcm2835_emmc_zero_fill(bcm2835_emmc_state *s, uint32_t nb)
+{
+    int64_t chunk = s->blk_sector / ZERO_CHUNK_SECTORS;
+    int64_t end;
+
+    if (!s->zero_map || !test_bit(chunk, s->zero_map)) {
+        return 0;
+    }
+    end = find_next_zero_bit(s->zero_map, s->zero_chunks, chunk)
+        * ZERO_CHUNK_SECTORS;
+    nb = MIN(nb, end - s->blk_sector);
+    memset(s->fifo, 0, nb * BLK_SIZE);
+    s->fifo_len = nb * BLK_SIZE;
+    s->blk_sector += nb;
+    s->ra_next = s->blk_sector;
+    s->stats.zero_blocks += nb;
+    return 1;
+}
+
+/* Fold len bytes into an FNV-1a hash */
+static uint64_t bcm2835_emmc_prof_fold(uint64_t hash, const uint8_t *buf,
+    uint32_t len)
+{
+    uint32_t n;
+
+    for (n = 0; n < len; n++) {
+        hash = (hash ^ buf[n]) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+/* Fold nb blocks at sector into an FNV-1a hash */
+static int bcm2835_emmc_prof_hash_blocks(bcm2835_emmc_state *s,
+    uint8_t *buf, int64_t sector, uint32_t nb, uint64_t *hash)
+{
+    if (bdrv_read(s->bdrv, sector, buf, nb) < 0) {
+        return -1;
+    }
+    *hash = bcm2835_emmc_prof_fold(*hash, buf, nb * BLK_SIZE);
+    return 0;
+}
+
+/* Start a profile hash with the image size and the partition table.
+ * Returns 0 if the image cannot be read.
+ */
+static uint64_t bcm2835_emmc_prof_hash_start(bcm2835_emmc_state *s)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL ^ s->prof_sectors;
+    uint8_t *buf;
+
+    buf = qemu_blockalign(s->bdrv, BLK_SIZE);
+    if (bcm2835_emmc_prof_hash_blocks(s, buf, 0, 1, &hash) < 0) {
+        hash = 0;
+    }
+    qemu_vfree(buf);
+    return hash;
+}
+
+/* Fold the blocks of an extent into a profile hash, as long as *left
+ * of the hashed blocks remain. Returns 0 if the image cannot be read.
+ */
+static uint64_t bcm2835_emmc_prof_hash_extent(bcm2835_emmc_state *s,
+    uint64_t hash, uint32_t *left, int64_t sector, uint32_t count)
+{
+    uint32_t done, nb;
+    uint8_t *buf;
+
+    if (!hash || *left == 0) {
+        return hash;
+    }
+    buf = qemu_blockalign(s->bdrv, BLK_BUF_SIZE);
+    for (done = 0; done < count && *left > 0; done += nb) {
+        nb = MIN(MIN(count - done, *left), BLK_BUF_BLOCKS);
+        if (bcm2835_emmc_prof_hash_blocks(s, buf, sector + done, nb,
+            &hash) < 0) {
+            hash = 0;
+            break;
+        }
+        *left -= nb;
+    }
+    qemu_vfree(buf);
+    return hash;
+}
+
+/* Hash the partition table and the first hashed blocks a profile
+ * covers, to tell whether it was recorded on this image. Returns 0 if
+ * the image cannot be read.
+ */
+static uint64_t bcm2835_emmc_prof_hash(bcm2835_emmc_state *s,
+    bcm2835_emmc_extent *ext, uint32_t count, uint32_t hashed)
+{
+    uint64_t hash = bcm2835_emmc_prof_hash_start(s);
+    uint32_t left = hashed;
+    uint32_t i;
+
+    for (i = 0; i < count && left > 0 && hash; i++) {
+        hash = bcm2835_emmc_prof_hash_extent(s, hash, &left, ext[i].sector,
+            ext[i].count);
+    }
+    return hash;
+}
+
+/* Note that the guest reads nb blocks at sector, merging with the last
+ * extent when it carries on from there. Returns where the blocks are in
+ * the extents, or -1 if they are not recorded.
+ */
+static int64_t bcm2835_emmc_prof_record(bcm2835_emmc_state *s,
+    int64_t sector, uint32_t nb)
+{
+    bcm2835_emmc_extent *last = NULL;
+    int64_t pos;
+
+    if (!s->prof_recording) {
+        return -1;
+    }
+    if (s->prof_nrec > 0) {
+        last = &s->prof_rec[s->prof_nrec - 1];
+        if (sector >= last->sector && sector <= last->sector + last->count
+            && sector + nb - last->sector <= 0x10000) {
+            // Carries on, or the same fill again after a short one or
+            // after waiting for the block layer
+            pos = s->prof_rec_blocks - last->count + (sector - last->sector);
+            if (sector + nb > last->sector + last->count) {
+                s->prof_rec_blocks += sector + nb - last->sector
+                    - last->count;
+                last->count = sector + nb - last->sector;
+            }
+            return pos;
+        }
+    }
+    if (s->prof_nrec == PROF_MAX_EXTENTS) {
+        s->prof_recording = 0;
+        return -1;
+    }
+    if (s->prof_nrec == s->prof_rec_alloc) {
+        s->prof_rec_alloc = MAX(s->prof_rec_alloc * 2, 256);
+        s->prof_rec = g_renew(bcm2835_emmc_extent, s->prof_rec,
+            s->prof_rec_alloc);
+    }
+    s->prof_rec[s->prof_nrec].sector = sector;
+    s->prof_rec[s->prof_nrec].count = nb;
+    s->prof_rec[s->prof_nrec].pad = 0;
+    s->prof_nrec++;
+    pos = s->prof_rec_blocks;
+    s->prof_rec_blocks += nb;
+    return pos;
+}
+
+/* Fold the blocks that just landed in the FIFO into the profile hash,
+ * while they are still what the image held when the guest first read
+ * them: by the time the profile is saved, the boot may have written over
+ * them. The hash covers the first PROF_HASH_SECTORS blocks of the
+ * extents, in order.
+ */
+static void bcm2835_emmc_prof_hash_fifo(bcm2835_emmc_state *s)
+{
+    int64_t pos = s->prof_fill_pos;
+    uint32_t nb = s->fifo_len / BLK_SIZE;
+    uint32_t skip, count;
+
+    s->prof_fill_pos = -1;
+    if (!s->prof_recording || pos < 0 || s->prof_hash_end || !s->prof_hash
+        || s->prof_hashed >= PROF_HASH_SECTORS) {
+        return;
+    }
+    if (pos > s->prof_hashed) {
+        // A fill before this one was dropped unread
+        s->prof_hash_end = 1;
+        return;
+    }
+    skip = s->prof_hashed - pos;
+    if (skip >= nb) {
+        return;
+    }
+    count = MIN(nb - skip, PROF_HASH_SECTORS - s->prof_hashed);
+    s->prof_hash = bcm2835_emmc_prof_fold(s->prof_hash,
+        s->fifo + skip * BLK_SIZE, count * BLK_SIZE);
+    s->prof_hashed += count;
+}
+
+/* Write what this boot read so far, through a temporary file so that a
+ * crash never leaves half a profile behind.
+ */
+static void bcm2835_emmc_prof_save(bcm2835_emmc_state *s)
+{
+    bcm2835_emmc_prof_hdr hdr;
+    bcm2835_emmc_extent ext;
+    char *tmp;
+    FILE *f;
+    uint32_t n;
+    int ok;
+
+    if (s->prof_nrec == 0) {
+        return;
+    }
+    memcpy(hdr.magic, PROF_MAGIC, sizeof(hdr.magic));
+    hdr.sectors = cpu_to_le64(s->prof_sectors);
+    hdr.hash = cpu_to_le64(s->prof_hash);
+    hdr.count = cpu_to_le32(s->prof_nrec);
+    hdr.hashed = cpu_to_le32(s->prof_hashed);
+    if (hdr.hash == 0) {
+        return;
+    }
+
+    tmp = g_strdup_printf("%s.tmp", s->prof_path);
+    f = fopen(tmp, "wb");
+    ok = f && fwrite(&hdr, sizeof(hdr), 1, f) == 1;
+    for (n = 0; ok && n < s->prof_nrec; n++) {
+        ext.sector = cpu_to_le64(s->prof_rec[n].sector);
+        ext.count = cpu_to_le32(s->prof_rec[n].count);
+        ext.pad = 0;
+        ok = fwrite(&ext, sizeof(ext), 1, f) == 1;
+    }
+    if (f && fclose(f) != 0) {
+        ok = 0;
+    }
+    if (!ok || rename(tmp, s->prof_path) < 0) {
+        fprintf(stderr, "bcm2835_emmc: cannot write boot profile %s\n",
+            s->prof_path);
+        unlink(tmp);
+    }
+    g_free(tmp);
+}
+
+/* Drop the boot cache. Prefetches in flight free themselves. */
+static void bcm2835_emmc_prof_release(bcm2835_emmc_state *s)
+{
+    GSList *l;
+
+    if (!s->prof_cache) {
+        return;
+    }
+    g_hash_table_destroy(s->prof_cache);
+    s->prof_cache = NULL;
+    for (l = s->prof_bufs; l; l = l->next) {
+        qemu_vfree(l->data);
+    }
+    g_slist_free(s->prof_bufs);
+    s->prof_bufs = NULL;
+    g_free(s->prof_chunks);
+    s->prof_chunks = NULL;
+    s->prof_nchunks = 0;
+    s->prof_next = 0;
+    s->prof_bytes = 0;
+}
+
+static void bcm2835_emmc_prof_pump(bcm2835_emmc_state *s);
+
+static void bcm2835_emmc_prof_done(void *opaque, int ret)
+{
+    bcm2835_emmc_prof_run *r = (bcm2835_emmc_prof_run *)opaque;
+    bcm2835_emmc_state *s = (bcm2835_emmc_state *)r->emmc;
+    uint32_t n;
+
+    s->prof_runs = g_slist_remove(s->prof_runs, r);
+    if (!s->prof_cache || ret < 0 || r->stale) {
+        qemu_vfree(r->buf);
+    } else {
+        for (n = 0; n < r->count; n++) {
+            g_hash_table_insert(s->prof_cache,
+                GUINT_TO_POINTER(r->chunk + n),
+                r->buf + n * PROF_CHUNK_SECTORS * BLK_SIZE);
+        }
+        s->prof_bufs = g_slist_prepend(s->prof_bufs, r->buf);
+    }
+    g_free(r);
+    if (s->prof_cache) {
+        bcm2835_emmc_prof_pump(s);
+    }
+}
+
+/* Keep PROF_INFLIGHT prefetches going down the profile, each a run of
+ * chunks the boot read one after the other, until the memory cap.
+ */
+static void bcm2835_emmc_prof_pump(bcm2835_emmc_state *s)
+{
+    bcm2835_emmc_prof_run *r;
+    uint32_t chunk, count, bytes;
+    int64_t sector;
+
+    while (g_slist_length(s->prof_runs) < PROF_INFLIGHT
+        && s->prof_next < s->prof_nchunks) {
+        chunk = s->prof_chunks[s->prof_next++];
+        count = 1;
+        while (count < PROF_RUN_CHUNKS && s->prof_next < s->prof_nchunks
+            && s->prof_chunks[s->prof_next] == chunk + count) {
+            s->prof_next++;
+            count++;
+        }
+        bytes = count * PROF_CHUNK_SECTORS * BLK_SIZE;
+        if (s->prof_bytes + bytes > s->prof_max_bytes) {
+            s->prof_next = s->prof_nchunks;
+            break;
+        }
+        s->prof_bytes += bytes;
+
+        sector = (int64_t)chunk * PROF_CHUNK_SECTORS;
+        r = g_new0(bcm2835_emmc_prof_run, 1);
+        r->emmc = s;
+        r->buf = qemu_blockalign(s->bdrv, bytes);
+        r->chunk = chunk;
+        r->count = count;
+        r->iov.iov_base = r->buf;
+        r->iov.iov_len = MIN(count * PROF_CHUNK_SECTORS,
+            s->prof_sectors - sector) * BLK_SIZE;
+        qemu_iovec_init_external(&r->qiov, &r->iov, 1);
+        s->prof_runs = g_slist_prepend(s->prof_runs, r);
+        if (!bdrv_aio_readv(s->bdrv, sector, &r->qiov,
+            r->iov.iov_len / BLK_SIZE, bcm2835_emmc_prof_done, r)) {
+            s->prof_runs = g_slist_remove(s->prof_runs, r);
+            qemu_vfree(r->buf);
+            g_free(r);
+        }
+    }
+}
+
+static gboolean bcm2835_emmc_prof_in_range(gpointer key, gpointer value,
+    gpointer opaque)
+{
+    int64_t *range = (int64_t *)opaque;
+    int64_t chunk = GPOINTER_TO_UINT(key);
+
+    return chunk >= range[0] && chunk <= range[1];
+}
+
+/* Drop boot cache data overlapping nb blocks at sector */
+static void bcm2835_emmc_prof_invalidate(bcm2835_emmc_state *s,
+    int64_t sector, int64_t nb)
+{
+    bcm2835_emmc_prof_run *r;
+    int64_t range[2];
+    int64_t chunk;
+    GSList *l;
+
+    if (!s->prof_cache) {
+        return;
+    }
+    range[0] = sector / PROF_CHUNK_SECTORS;
+    range[1] = nb > s->prof_sectors ? INT64_MAX
+        : (sector + nb - 1) / PROF_CHUNK_SECTORS;
+    if (range[1] - range[0] < PROF_RUN_CHUNKS) {
+        for (chunk = range[0]; chunk <= range[1]; chunk++) {
+            g_hash_table_remove(s->prof_cache, GUINT_TO_POINTER(chunk));
+        }
+    } else {
+        g_hash_table_foreach_remove(s->prof_cache,
+            bcm2835_emmc_prof_in_range, range);
+    }
+    for (l = s->prof_runs; l; l = l->next) {
+        r = (bcm2835_emmc_prof_run *)l->data;
+        if (range[0] < r->chunk + r->count && r->chunk <= range[1]) {
+            r->stale = 1;
+        }
+    }
+}
+
+/* Serve a FIFO fill of up to nb blocks from the boot cache. Returns 1
+ * if the FIFO was filled. A profile that keeps missing was recorded on
+ * a different boot and is dropped.
+ */
+static int bcm2835_emmc_prof_fill(bcm2835_emmc_state *s, uint32_t nb)
+{
+    int64_t chunk = s->blk_sector / PROF_CHUNK_SECTORS;
+    uint32_t off = s->blk_sector % PROF_CHUNK_SECTORS;
+    uint64_t total;
+    uint8_t *data;
+
+    if (!s->prof_cache) {
+        return 0;
+    }
+    data = g_hash_table_lookup(s->prof_cache, GUINT_TO_POINTER(chunk));
+    if (!data) {
+        s->stats.prof_misses++;
+        total = s->stats.prof_hits + s->stats.prof_misses;
+        if (total >= PROF_SAMPLE && s->stats.prof_hits * 4 < total) {
+            fprintf(stderr, "bcm2835_emmc: boot profile %s does not match "
+                "this boot, dropped\n", s->prof_path);
+            bcm2835_emmc_prof_release(s);
+        }
+        return 0;
+    }
+
+    s->stats.prof_hits++;
+    nb = MIN(nb, PROF_CHUNK_SECTORS - off);
+    memcpy(s->fifo, data + off * BLK_SIZE, nb * BLK_SIZE);
+    s->fifo_len = nb * BLK_SIZE;
+    s->blk_sector += nb;
+    s->ra_next = s->blk_sector;
+    return 1;
+}
+
+/* End of the boot: keep its profile for the next one and free the
+ * cache, the rest of the run has nothing to gain from it.
+ */
+static void bcm2835_emmc_prof_tick(void *opaque)
+{
+    bcm2835_emmc_state *s = (bcm2835_emmc_state *)opaque;
+
+    if (s->prof_recording) {
+        s->prof_recording = 0;
+        bcm2835_emmc_prof_save(s);
+    }
+    bcm2835_emmc_prof_release(s);
+}
+
+/* Prefetch once the guest runs, save the profile when it stops */
+static void bcm2835_emmc_prof_vm_state(void *opaque, int running,
+    RunState state)
+{
+    bcm2835_emmc_state *s = (bcm2835_emmc_state *)opaque;
+
+    if (running) {
+        if (s->prof_cache) {
+            bcm2835_emmc_prof_pump(s);
+        }
+    } else if (s->prof_recording) {
+        bcm2835_emmc_prof_save(s);
+    }
+}
+
+/* Load the profile of an earlier boot of this image, if there is one,
+ * as the list of chunks to prefetch. Profiles of other images or of an
+ * image that changed since are ignored, and replaced by this boot's.
+ */
+static void bcm2835_emmc_prof_load(bcm2835_emmc_state *s)
+{
+    bcm2835_emmc_prof_hdr hdr;
+    bcm2835_emmc_extent *ext = NULL;
+    GHashTable *seen;
+    uint32_t count = 0;
+    uint64_t chunk, last;
+    uint32_t n;
+    FILE *f;
+    int ok;
+
+    f = fopen(s->prof_path, "rb");
+    if (!f) {
+        // First boot, nothing to replay yet
+        return;
+    }
+    ok = fread(&hdr, sizeof(hdr), 1, f) == 1
+        && memcmp(hdr.magic, PROF_MAGIC, sizeof(hdr.magic)) == 0
+        && le64_to_cpu(hdr.sectors) == s->prof_sectors;
+    if (ok) {
+        count = le32_to_cpu(hdr.count);
+        ok = count > 0 && count <= PROF_MAX_EXTENTS;
+    }
+    if (ok) {
+        ext = g_new(bcm2835_emmc_extent, count);
+        ok = fread(ext, sizeof(*ext), count, f) == count;
+    }
+    fclose(f);
+    for (n = 0; ok && n < count; n++) {
+        ext[n].sector = le64_to_cpu(ext[n].sector);
+        ext[n].count = le32_to_cpu(ext[n].count);
+        ok = ext[n].count > 0 && ext[n].sector < s->prof_sectors
+            && ext[n].count <= s->prof_sectors - ext[n].sector;
+    }
+    if (ok) {
+        ok = le32_to_cpu(hdr.hashed) <= PROF_HASH_SECTORS
+            && bcm2835_emmc_prof_hash(s, ext, count,
+                le32_to_cpu(hdr.hashed)) == le64_to_cpu(hdr.hash);
+    }
+    if (!ok) {
+        fprintf(stderr, "bcm2835_emmc: boot profile %s is stale, "
+            "recording a new one\n", s->prof_path);
+        g_free(ext);
+        return;
+    }
+
+    // Each chunk once, where the boot first needed it
+    seen = g_hash_table_new(g_direct_hash, g_direct_equal);
+    s->prof_chunks = g_new(uint32_t, s->prof_max_bytes
+        / (PROF_CHUNK_SECTORS * BLK_SIZE) + 1);
+    s->prof_nchunks = 0;
+    for (n = 0; n < count; n++) {
+        last = (ext[n].sector + ext[n].count - 1) / PROF_CHUNK_SECTORS;
+        for (chunk = ext[n].sector / PROF_CHUNK_SECTORS; chunk <= last;
+            chunk++) {
+            if (s->prof_nchunks * PROF_CHUNK_SECTORS * BLK_SIZE
+                >= s->prof_max_bytes) {
+                break;
+            }
+            if (!g_hash_table_lookup_extended(seen,
+                GUINT_TO_POINTER(chunk), NULL, NULL)) {
+                g_hash_table_insert(seen, GUINT_TO_POINTER(chunk), NULL);
+                s->prof_chunks[s->prof_nchunks++] = chunk;
+            }
+        }
+    }
+    g_hash_table_destroy(seen);
+    g_free(ext);
+    s->prof_cache = g_hash_table_new(g_direct_hash, g_direct_equal);
+}
+
+/* Drop read-ahead data overlapping nb blocks at sector */
+static void bcm2835_emmc_ra_invalidate(bcm2835_emmc_state *s,
+    int64_t sector, int64_t nb)
+{
+    bcm2835_emmc_ra *w;
+    int n;
+
+    for (n = 0; n < RA_WINDOWS; n++) {
+        w = &s->ra[n];
+        if (w->count > 0 && sector < w->sector + w->count
+            && w->sector < sector + nb) {
+            if (w->aiocb) {
+                w->stale = 1;
+            } else {
+                w->count = 0;
+            }
+        }
+    }
+    bcm2835_emmc_prof_invalidate(s, sector, nb);
+}
+
+static bcm2835_emmc_ra *bcm2835_emmc_ra_find(bcm2835_emmc_state *s,
+    int64_t sector)
+{
+    bcm2835_emmc_ra *w;
+    int n;
+
+    for (n = 0; n < RA_WINDOWS; n++) {
+        w = &s->ra[n];
+        if (w->count > 0 && !w->stale && sector >= w->sector
+            && sector < w->sector + w->count) {
+            return w;
+        }
+    }
+    return NULL;
+}
+
+static void bcm2835_emmc_ra_done(void *opaque, int ret)
+{
+    bcm2835_emmc_ra *w = (bcm2835_emmc_ra *)opaque;
+    bcm2835_emmc_state *s = (bcm2835_emmc_state *)w->emmc;
+
+    w->aiocb = NULL;
+    if (ret < 0 || w->stale) {
+        w->count = 0;
+        w->stale = 0;
+    }
+    if (s->ra_wait == w) {
+        // A FIFO fill was waiting on this window, go again
+        s->ra_wait = NULL;
+        bcm2835_emmc_fifo_fill(s);
+        if (!bcm2835_emmc_busy(s)) {
+            bcm2835_emmc_data_resume(s);
+        }
+    }
+}
+
+/* Start loading the window of blocks at sector in the background,
+ * into a window that is neither loading nor being read from.
+ */
+static void bcm2835_emmc_ra_prefetch(bcm2835_emmc_state *s, int64_t sector,
+    bcm2835_emmc_ra *cur)
+{
+    bcm2835_emmc_ra *w = NULL;
+    uint32_t nb;
+    int n;
+
+    if (s->ra_window == 0 || sector >= s->blk_sectors
+        || bcm2835_emmc_ra_find(s, sector)) {
+        return;
+    }
+    for (n = 0; n < RA_WINDOWS; n++) {
+        if (!s->ra[n].aiocb && &s->ra[n] != cur) {
+            w = &s->ra[n];
+            break;
+        }
+    }
+    if (!w) {
+        return;
+    }
+
+    nb = MIN(s->ra_window, s->blk_sectors - sector);
+    w->sector = sector;
+    w->count = nb;
+    w->stale = 0;
+    w->iov.iov_base = w->buf;
+    w->iov.iov_len = nb * BLK_SIZE;
+    qemu_iovec_init_external(&w->qiov, &w->iov, 1);
+    w->aiocb = bdrv_aio_readv(s->bdrv, sector, &w->qiov, nb,
+        bcm2835_emmc_ra_done, w);
+    if (!w->aiocb) {
+        w->count = 0;
+    }
+}
+
+/* Serve a FIFO fill of up to nb blocks from the read-ahead windows.
+ * Returns 1 if the FIFO was filled or waits for a window to load, 0 if
+ * the blocks have to be read from the image.
+ */
+static int bcm2835_emmc_ra_fill(bcm2835_emmc_state *s, uint32_t nb)
+{
+    bcm2835_emmc_ra *w;
+    int seq = (s->blk_sector == s->ra_next);
+
+    if (s->ra_window == 0) {
+        return 0;
+    }
+    w = bcm2835_emmc_ra_find(s, s->blk_sector);
+    if (!w) {
+        s->ra_misses++;
+        s->ra_next = s->blk_sector + nb;
+        if (seq) {
+            bcm2835_emmc_ra_prefetch(s, s->ra_next, NULL);
+        }
+        return 0;
+    }
+    if (w->aiocb) {
+        s->ra_wait = w;
+        return 1;
+    }
+
+    s->ra_hits++;
+    nb = MIN(nb, w->sector + w->count - s->blk_sector);
+    memcpy(s->fifo, w->buf + (s->blk_sector - w->sector) * BLK_SIZE,
+        nb * BLK_SIZE);
+    s->fifo_len = nb * BLK_SIZE;
+    s->blk_sector += nb;
+    s->ra_next = s->blk_sector;
+    // Keep the stream one window ahead of the reader
+    bcm2835_emmc_ra_prefetch(s, w->sector + w->count, w);
+    return 1;
+}
+
+static void bcm2835_emmc_blk_error(bcm2835_emmc_state *s)
+{
+    s->blocks_left = 0;
+    s->dma_paused = 0;
+    s->fifo_pos = 0;
+    s->fifo_len = 0;
+    s->status &= ~SDHCI_DATA_INHIBIT;
+    s->interrupt |= SDHCI_INT_DATA_CRC | SDHCI_INT_ERROR;
+}
+
+static void bcm2835_emmc_aio_done(void *opaque, int ret)
+{
+    bcm2835_emmc_state *s = (bcm2835_emmc_state *)opaque;
+
+    if (s->aio_cancel) {
+        return;
+    }
+    s->aiocb = NULL;
+    trace_bcm2835_emmc_aio_done(s, s->blk_sector, s->aio_blocks, ret);
+    if (ret < 0) {
+        bcm2835_emmc_blk_error(s);
+        bcm2835_emmc_set_irq(s);
+        bcm2835_emmc_update_dreq(s);
+        return;
+    }
+
+    s->blk_sector += s->aio_blocks;
+    if (s->blk_read) {
+        s->fifo_len = s->aio_blocks * BLK_SIZE;
+        bcm2835_emmc_prof_hash_fifo(s);
+    }
+    s->fifo_pos = 0;
+    bcm2835_emmc_data_resume(s);
+}
+
+/* Read or write the first nb blocks of the FIFO at blk_sector. The data
+ * phase stalls until bcm2835_emmc_aio_done() resumes it.
+ */
+static void bcm2835_emmc_aio_start(bcm2835_emmc_state *s, uint32_t nb)
+{
+    s->iov.iov_base = s->fifo;
+    s->iov.iov_len = nb * BLK_SIZE;
+    qemu_iovec_init_external(&s->qiov, &s->iov, 1);
+    s->aio_blocks = nb;
+    trace_bcm2835_emmc_aio_start(s, s->blk_sector, nb, s->blk_read);
+    if (s->blk_read) {
+        s->aiocb = bdrv_aio_readv(s->bdrv, s->blk_sector, &s->qiov, nb,
+            bcm2835_emmc_aio_done, s);
+    } else {
+        bcm2835_emmc_ra_invalidate(s, s->blk_sector, nb);
+        bcm2835_emmc_zero_clear(s, s->blk_sector, nb);
+        s->aiocb = bdrv_aio_writev(s->bdrv, s->blk_sector, &s->qiov, nb,
+            bcm2835_emmc_aio_done, s);
+    }
+    if (!s->aiocb) {
+        bcm2835_emmc_blk_error(s);
+    }
+}
+
+/* End the data phase: cancel a read in flight, wait for a write or a
+ * discard to land, without resuming the data phase either way.
+ */
+static void bcm2835_emmc_aio_stop(bcm2835_emmc_state *s)
+{
+    BlockDriverAIOCB *acb;
+
+    s->ra_wait = NULL;
+    if (s->throttled) {
+        qemu_del_timer(s->thr_timer);
+        s->throttled = 0;
+        if (s->thr_flush_pending) {
+            // Written blocks still have to make it to the image
+            s->thr_flush_pending = 0;
+            bcm2835_emmc_fifo_commit(s);
+        }
+    }
+    s->aio_cancel = 1;
+    acb = s->aiocb;
+    if (acb && s->blk_read) {
+        s->aiocb = NULL;
+        bdrv_aio_cancel(acb);
+    }
+    if (s->aiocb || s->discard_acb) {
+        // Writes and discards are not cancelled: they have to land
+        // before whatever the next command does there, and a discard
+        // ends the busy phase
+        bdrv_drain_all();
+        s->aiocb = NULL;
+    }
+    s->aio_cancel = 0;
+}
+
+/* Read a byte of data from the card model, advertising what the
+ * controller handles on the card's behalf in the registers it sends.
+ */
+static uint8_t bcm2835_emmc_card_read(bcm2835_emmc_state *s)
+{
+    uint8_t value = sd_read_data(s->card);
+
+    if (s->data_cmd == SD_ACMD(51) && s->data_count == 3) {
+        value |= SD_SCR_CMD23;
+    }
+    if (s->data_cmd == SD_ACMD(13)) {
+        switch (s->data_count) {
+        case 10:
+            value = (value & 0x0f) | (SD_SSR_AU_SIZE << 4);
+            break;
+        case 11:
+            value = SD_SSR_ERASE_SIZE >> 8;
+            break;
+        case 12:
+            value = SD_SSR_ERASE_SIZE & 0xff;
+            break;
+        case 13:
+            value = SD_SSR_ERASE_TIMEOUT << 2;
+            break;
+        }
+    }
+    s->data_count++;
+    return value;
+}
+
+static int bcm2835_emmc_card_status(bcm2835_emmc_state *s, uint32_t *status);
+
+/* Stop the card at the end of a multi-block transfer the guest will not
+ * stop itself: it either set the block count up front with CMD23, or
+ * asked for Auto CMD12, whose response goes to RESP3.
+ */
+static void bcm2835_emmc_auto_stop(bcm2835_emmc_state *s)
+{
+    SDRequest request;
+    uint8_t response[16];
+    uint32_t status = 0;
+
+    if (!s->stop_pending) {
+        return;
+    }
+    s->stop_pending = 0;
+    if (s->blk_active) {
+        s->blk_stop = 0;
+        bcm2835_emmc_card_status(s, &status);
+    } else {
+        request.cmd = 12;
+        request.arg = 0;
+        request.crc = 0;
+        if (sd_do_command(s->card, &request, response) == 4) {
+            status = (response[0] << 24) | (response[1] << 16)
+                | (response[2] << 8) | response[3];
+        }
+    }
+    if (s->cmdtm & SDHCI_TRNS_AUTO_CMD12) {
+        s->resp3 = status;
+    }
+}
+
+static void bcm2835_emmc_ram_flush_next(bcm2835_emmc_state *s);
+
+static void bcm2835_emmc_ram_flush_done(void *opaque, int ret)
+{
+    bcm2835_emmc_state *s = (bcm2835_emmc_state *)opaque;
+    int64_t start = (uint8_t *)s->ram_iov.iov_base - s->ram;
+
+    if (ret < 0) {
+        // Keep the blocks dirty and try again later
+        fprintf(stderr, "bcm2835_emmc: image write-back failed (%d)\n", ret);
+        start /= RAM_CHUNK_SECTORS * BLK_SIZE;
+        bitmap_set(s->ram_dirty, start,
+            DIV_ROUND_UP(s->ram_iov.iov_len, RAM_CHUNK_SECTORS * BLK_SIZE));
+        s->ram_flushing = 0;
+        qemu_mod_timer(s->ram_timer, qemu_get_clock_ms(rt_clock)
+            + s->ram_flush_ms);
+        return;
+    }
+    bcm2835_emmc_ram_flush_next(s);
+}
+
+/* Write the next run of dirty chunks back to the image, as one request
+ * of up to RAM_FLUSH_CHUNKS chunks. Runs are cleared before the write
+ * is issued, so a chunk the guest writes again meanwhile goes out with
+ * a later run.
+ */
+static void bcm2835_emmc_ram_flush_next(bcm2835_emmc_state *s)
+{
+    int64_t start, end, sector;
+    uint32_t nb;
+
+    start = find_next_bit(s->ram_dirty, s->ram_chunks, s->ram_cursor);
+    if (start >= s->ram_chunks) {
+        start = find_next_bit(s->ram_dirty, s->ram_chunks, 0);
+    }
+    if (start >= s->ram_chunks) {
+        s->ram_flushing = 0;
+        return;
+    }
+    end = find_next_zero_bit(s->ram_dirty, s->ram_chunks, start);
+    end = MIN(end, start + RAM_FLUSH_CHUNKS);
+    bitmap_clear(s->ram_dirty, start, end - start);
+    s->ram_cursor = end;
+
+    sector = start * RAM_CHUNK_SECTORS;
+    nb = MIN((end - start) * RAM_CHUNK_SECTORS, s->blk_sectors - sector);
+    s->ram_iov.iov_base = s->ram + sector * BLK_SIZE;
+    s->ram_iov.iov_len = nb * BLK_SIZE;
+    qemu_iovec_init_external(&s->ram_qiov, &s->ram_iov, 1);
+    s->ram_flushing = 1;
+    if (!bdrv_aio_writev(s->bdrv, sector, &s->ram_qiov, nb,
+        bcm2835_emmc_ram_flush_done, s)) {
+        bcm2835_emmc_ram_flush_done(s, -EIO);
+    }
+}
+
+static void bcm2835_emmc_ram_tick(void *opaque)
+{
+    bcm2835_emmc_state *s = (bcm2835_emmc_state *)opaque;
+
+    if (!s->ram_flushing) {
+        bcm2835_emmc_ram_flush_next(s);
+    }
+}
+
+/* Flush everything when the guest stops. This is the only point where
+ * the image is known to hold all the writes: otherwise they reach it up
+ * to ram-flush-ms later, plus the time the write-back takes. QEMU closes
+ * the drives on quit, a guest poweroff or SIGTERM without stopping the
+ * guest first, so the writes of that last period are lost then, as they
+ * are on a crash. Stop the guest first (the "stop" monitor command, or
+ * -no-shutdown for a guest poweroff) to keep them.
+ */
+static void bcm2835_emmc_ram_vm_state(void *opaque, int running,
+    RunState state)
+{
+    bcm2835_emmc_state *s = (bcm2835_emmc_state *)opaque;
+
+    if (running || !s->ram_writeback) {
+        return;
+    }
+    qemu_del_timer(s->ram_timer);
+    if (!s->ram_flushing) {
+        bcm2835_emmc_ram_flush_next(s);
+    }
+    bdrv_drain_all();
+}
+
+/* Mark nb blocks at sector for write-back */
+static void bcm2835_emmc_ram_mark(bcm2835_emmc_state *s, int64_t sector,
+    uint32_t nb)
+{
+    int64_t first = sector / RAM_CHUNK_SECTORS;
+    int64_t last = (sector + nb - 1) / RAM_CHUNK_SECTORS;
+
+    if (!s->ram_writeback) {
+        return;
+    }
+    bitmap_set(s->ram_dirty, first, last - first + 1);
+    if (!s->ram_flushing && !qemu_timer_pending(s->ram_timer)) {
+        // Let writes pile up into longer runs first
+        qemu_mod_timer(s->ram_timer, qemu_get_clock_ms(rt_clock)
+            + s->ram_flush_ms);
+    }
+}
+
+static void bcm2835_emmc_ram_write(bcm2835_emmc_state *s, int64_t sector,
+    uint32_t nb)
+{
+    memcpy(s->ram + sector * BLK_SIZE, s->fifo, nb * BLK_SIZE);
+    bcm2835_emmc_ram_mark(s, sector, nb);
+}
+
+/* Load the whole image into anonymous memory, huge pages if possible */
+static void bcm2835_emmc_ram_load(bcm2835_emmc_state *s)
+{
+    int64_t sector;
+    uint32_t nb;
+
+    s->blk_sectors = bdrv_getlength(s->bdrv) >> 9;
+    s->ram = qemu_vmalloc(s->blk_sectors * BLK_SIZE);
+    qemu_madvise(s->ram, s->blk_sectors * BLK_SIZE, QEMU_MADV_HUGEPAGE);
+    for (sector = 0; sector < s->blk_sectors; sector += nb) {
+        nb = MIN(RAM_LOAD_SECTORS, s->blk_sectors - sector);
+        if (bdrv_read(s->bdrv, sector, s->ram + sector * BLK_SIZE, nb) < 0) {
+            fprintf(stderr, "bcm2835_emmc: cannot load SD image\n");
+            exit(1);
+        }
+    }
+
+    s->ram_chunks = DIV_ROUND_UP(s->blk_sectors, RAM_CHUNK_SECTORS);
+    s->ram_dirty = bitmap_new(s->ram_chunks);
+    s->ram_cursor = 0;
+    s->ram_flushing = 0;
+    s->ram_timer = qemu_new_timer_ms(rt_clock, bcm2835_emmc_ram_tick, s);
+    qemu_add_vm_change_state_handler(bcm2835_emmc_ram_vm_state, s);
+}
+
+static void bcm2835_emmc_fifo_fill(bcm2835_emmc_state *s)
+{
+    uint32_t n;
+
+    s->fifo_pos = 0;
+    s->fifo_len = 0;
+    if (s->blk_active) {
+        // As many blocks of the command as fit, in one request
+        n = MIN(s->blocks_left, BLK_BUF_BLOCKS);
+        if (bcm2835_emmc_throttle_bytes(s, n * BLK_SIZE)) {
+            return;
+        }
+        s->prof_fill_pos = bcm2835_emmc_prof_record(s, s->blk_sector, n);
+        if (s->ram) {
+            memcpy(s->fifo, s->ram + s->blk_sector * BLK_SIZE, n * BLK_SIZE);
+            s->blk_sector += n;
+            s->fifo_len = n * BLK_SIZE;
+        } else if (bcm2835_emmc_zero_fill(s, n)
+            || bcm2835_emmc_prof_fill(s, n)
+            || bcm2835_emmc_ra_fill(s, n)) {
+            bcm2835_emmc_prof_hash_fifo(s);
+        } else {
+            bcm2835_emmc_aio_start(s, n);
+        }
+        return;
+    }
+
+    for (n = 0; n < s->blksize; n++) {
+        s->fifo[n] = bcm2835_emmc_card_read(s);
+    }
+    s->fifo_len = s->blksize;
+}
+
+/* Write the whole blocks in the FIFO to the image, past the throttle */
+static void bcm2835_emmc_fifo_commit(bcm2835_emmc_state *s)
+{
+    uint32_t n = s->fifo_pos / BLK_SIZE;
+
+    if (n > 0 && s->ram) {
+        bcm2835_emmc_ram_write(s, s->blk_sector, n);
+        s->blk_sector += n;
+        s->fifo_pos = 0;
+    } else if (n > 0) {
+        bcm2835_emmc_aio_start(s, n);
+    }
+}
+
+static void bcm2835_emmc_fifo_flush(bcm2835_emmc_state *s)
+{
+    uint32_t n;
+
+    if (s->blk_active) {
+        n = s->fifo_pos / BLK_SIZE;
+        if (n > 0 && bcm2835_emmc_throttle_bytes(s, n * BLK_SIZE)) {
+            s->thr_flush_pending = 1;
+        } else {
+            bcm2835_emmc_fifo_commit(s);
+        }
+        return;
+    }
+
+    for (n = 0; n < s->fifo_pos; n++) {
+        sd_write_data(s->card, s->fifo[n]);
+    }
+    s->fifo_pos = 0;
+}
+
+/* Return the FIFO bytes the next access of up to *len bytes goes
+ * through, refilling the FIFO for reads. *len is clipped so that the
+ * access stays within the current block, and is 0 while the FIFO waits
+ * for the block layer.
+ */
+static uint8_t *bcm2835_emmc_fifo_get(bcm2835_emmc_state *s, uint32_t *len)
+{
+    uint32_t avail;
+
+    if (bcm2835_emmc_busy(s)) {
+        avail = 0;
+    } else if (s->cmdtm & SDHCI_TRNS_READ) {
+        if (s->fifo_pos == s->fifo_len) {
+            bcm2835_emmc_fifo_fill(s);
+        }
+        avail = s->fifo_len - s->fifo_pos;
+    } else if (s->blk_active) {
+        avail = BLK_BUF_SIZE - s->fifo_pos;
+    } else {
+        avail = s->blksize - s->fifo_pos;
+    }
+    avail = MIN(avail, s->blksize - s->blk_pos);
+    *len = MIN(*len, avail);
+    return s->fifo + s->fifo_pos;
+}
+
+/* Account for len bytes moved through the FIFO. Returns 1 when that
+ * completed a block, committing written blocks to the card once the
+ * FIFO is full or the command has no blocks left.
+ */
+static int bcm2835_emmc_fifo_advance(bcm2835_emmc_state *s, uint32_t len)
+{
+    s->fifo_pos += len;
+    s->blk_pos += len;
+    if (s->blk_pos < s->blksize) {
+        return 0;
+    }
+    s->blk_pos = 0;
+    s->blocks_left--;
+    if (s->cmdtm & SDHCI_TRNS_READ) {
+        s->stats.blocks_read++;
+    } else {
+        s->stats.blocks_written++;
+    }
+    if (!(s->cmdtm & SDHCI_TRNS_READ)
+        && (s->blocks_left == 0 || s->fifo_pos == BLK_BUF_SIZE
+            || !s->blk_active)) {
+        bcm2835_emmc_fifo_flush(s);
+    }
+    return 1;
+}
+
+/* Move up to len bytes between the card and guest memory at addr, in
+ * the direction of the current command, through the FIFO. Returns the
+ * number of bytes moved, which is short of len once the last block of
+ * the command has gone through or the FIFO waits for the block layer.
+ */
+static uint32_t bcm2835_emmc_dma_move(bcm2835_emmc_state *s, hwaddr addr,
+    uint32_t len)
+{
+    uint32_t done = 0;
+    uint32_t n;
+    uint8_t *p;
+
+    while (done < len && s->blocks_left > 0) {
+        n = len - done;
+        p = bcm2835_emmc_fifo_get(s, &n);
+        if (n == 0) {
+            break;
+        }
+        if (s->cmdtm & SDHCI_TRNS_READ) {
+            cpu_physical_memory_write(addr + done, p, n);
+        } else {
+            cpu_physical_memory_read(addr + done, p, n);
+        }
+        bcm2835_emmc_fifo_advance(s, n);
+        done += n;
+    }
+    return done;
+}
+
+/* PIO through the data port on the block path. The interrupt status
+ * only changes when a block completes or the block layer catches up.
+ */
+static void bcm2835_emmc_pio_update(bcm2835_emmc_state *s)
+{
+    if (bcm2835_emmc_busy(s)) {
+        return;
+    }
+    if (s->blocks_left > 0) {
+        if (!s->blk_read) {
+            s->interrupt |= SDHCI_INT_SPACE_AVAIL;
+        } else if (s->fifo_pos < s->fifo_len) {
+            s->interrupt |= SDHCI_INT_DATA_AVAIL;
+        } else {
+            // Fetch ahead, DATA_AVAIL comes with the data
+            bcm2835_emmc_fifo_fill(s);
+        }
+    } else {
+        bcm2835_emmc_auto_stop(s);
+        s->status &= ~SDHCI_DATA_INHIBIT;
+        s->interrupt |= SDHCI_INT_DATA_END;
+        s->write_op = 0;
+    }
+}
+
+static uint32_t bcm2835_emmc_pio_read(bcm2835_emmc_state *s)
+{
+    uint8_t buf[4] = { 0, 0, 0, 0 };
+    uint32_t done = 0;
+    uint32_t n;
+    uint8_t *p;
+    int end = 0;
+
+    while (done < 4 && s->blocks_left > 0) {
+        n = 4 - done;
+        p = bcm2835_emmc_fifo_get(s, &n);
+        if (n == 0) {
+            break;
+        }
+        memcpy(buf + done, p, n);
+        end |= bcm2835_emmc_fifo_advance(s, n);
+        done += n;
+    }
+    if (end) {
+        bcm2835_emmc_pio_update(s);
+        bcm2835_emmc_set_irq(s);
+        bcm2835_emmc_update_dreq(s);
+    }
+    return ldl_le_p(buf);
+}
+
+static void bcm2835_emmc_pio_write(bcm2835_emmc_state *s, uint32_t value)
+{
+    uint8_t buf[4];
+    uint32_t done = 0;
+    uint32_t n;
+    uint8_t *p;
+    int end = 0;
+
+    stl_le_p(buf, value);
+    while (done < 4 && s->blocks_left > 0) {
+        n = 4 - done;
+        p = bcm2835_emmc_fifo_get(s, &n);
+        if (n == 0) {
+            break;
+        }
+        memcpy(p, buf + done, n);
+        end |= bcm2835_emmc_fifo_advance(s, n);
+        done += n;
+    }
+    if (end) {
+        bcm2835_emmc_pio_update(s);
+        bcm2835_emmc_set_irq(s);
+        bcm2835_emmc_update_dreq(s);
+    }
+}
+
+/* Ask the card for its R1 status with CMD13. The block path bypasses
+ * the card state machine for the data commands, and uses this both to
+ * check the card is ready for them and to answer them.
+ */
+static int bcm2835_emmc_card_status(bcm2835_emmc_state *s, uint32_t *status)
+{
+    SDRequest request;
+    uint8_t response[16];
+
+    request.cmd = 13;
+    request.arg = s->rca << 16;
+    request.crc = 0;
+    if (sd_do_command(s->card, &request, response) != 4) {
+        return 0;
+    }
+    *status = (response[0] << 24) | (response[1] << 16)
+        | (response[2] << 8) | response[3];
+    return 1;
+}
+
+static void bcm2835_emmc_erase_step(bcm2835_emmc_state *s);
+
+static void bcm2835_emmc_erase_done(void *opaque, int ret)
+{
+    bcm2835_emmc_state *s = (bcm2835_emmc_state *)opaque;
+
+    // Discard is advisory and a failed write just leaves the old data
+    // there, the erase carries on with the rest either way
+    s->discard_acb = NULL;
+    bcm2835_emmc_erase_step(s);
+}
+
+/* Write zeros over whatever the discard left allocated, one request at
+ * a time, then end the busy phase.
+ */
+static void bcm2835_emmc_erase_step(bcm2835_emmc_state *s)
+{
+    int64_t end = s->discard_sector + s->discard_nb;
+    int64_t first, last;
+    int ret, pnum;
+
+    while (s->erase_next < end) {
+        ret = bdrv_is_allocated_above(s->bdrv, NULL, s->erase_next,
+            MIN(end - s->erase_next, ZERO_SCAN_SECTORS), &pnum);
+        if (ret < 0 || pnum <= 0) {
+            // No block status, write the zeros to be sure
+            ret = 1;
+            pnum = MIN(end - s->erase_next, ERASE_ZERO_SECTORS);
+        }
+        if (ret == 0) {
+            s->erase_next += pnum;
+            continue;
+        }
+        pnum = MIN(pnum, ERASE_ZERO_SECTORS);
+        if (!s->erase_zeros) {
+            s->erase_zeros = qemu_blockalign(s->bdrv,
+                ERASE_ZERO_SECTORS * BLK_SIZE);
+            memset(s->erase_zeros, 0, ERASE_ZERO_SECTORS * BLK_SIZE);
+        }
+        s->erase_iov.iov_base = s->erase_zeros;
+        s->erase_iov.iov_len = pnum * BLK_SIZE;
+        qemu_iovec_init_external(&s->erase_qiov, &s->erase_iov, 1);
+        s->discard_acb = bdrv_aio_writev(s->bdrv, s->erase_next,
+            &s->erase_qiov, pnum, bcm2835_emmc_erase_done, s);
+        s->erase_next += pnum;
+        if (s->discard_acb) {
+            return;
+        }
+    }
+
+    if (s->zero_map) {
+        first = DIV_ROUND_UP(s->discard_sector, ZERO_CHUNK_SECTORS);
+        last = end == s->zero_sectors ? s->zero_chunks
+            : end / ZERO_CHUNK_SECTORS;
+        if (last > first) {
+            bitmap_set(s->zero_map, first, last - first);
+        }
+    }
+    s->status &= ~SDHCI_DATA_INHIBIT;
+    s->interrupt |= SDHCI_INT_DATA_END;
+    bcm2835_emmc_set_irq(s);
+}
+
+/* CMD38: erase the blocks from the CMD32 to the CMD33 address. They
+ * read as zeros afterwards, as the SCR (DATA_STAT_AFTER_ERASE) says, in
+ * memory and in the image alike: the image gets a discard, then zeros
+ * written over what it left allocated. The card stays busy
+ * (DATA_INHIBIT) until that is done, and the following commands wait
+ * for it. Returns R1 error bits.
+ */
+static uint32_t bcm2835_emmc_erase(bcm2835_emmc_state *s)
+{
+    int64_t start = s->erase_start;
+    int64_t nb = s->erase_end - s->erase_start + 1;
+    int64_t sectors = bdrv_getlength(s->bdrv) >> 9;
+    int64_t first, last;
+
+    s->erase_start = -1;
+    s->erase_end = -1;
+    if (start < 0 || nb <= 0) {
+        return SD_R1_ERASE_SEQ_ERROR;
+    }
+    if (start + nb > sectors) {
+        return SD_R1_ERASE_PARAM;
+    }
+    if (bdrv_is_read_only(s->bdrv)) {
+        return SD_R1_WP_ERASE_SKIP;
+    }
+
+    bcm2835_emmc_ra_invalidate(s, start, nb);
+    if (s->ram) {
+        if (s->ram_flushing) {
+            // Do not let an older write-back land after the discard
+            bdrv_drain_all();
+        }
+        memset(s->ram + start * BLK_SIZE, 0, nb * BLK_SIZE);
+        // Whole chunks go away with the discard, partial ones are written
+        first = DIV_ROUND_UP(start, RAM_CHUNK_SECTORS);
+        last = (start + nb) / RAM_CHUNK_SECTORS;
+        if (last > first) {
+            bitmap_clear(s->ram_dirty, first, last - first);
+        }
+        if (start % RAM_CHUNK_SECTORS) {
+            bcm2835_emmc_ram_mark(s, start, 1);
+        }
+        if ((start + nb) % RAM_CHUNK_SECTORS) {
+            bcm2835_emmc_ram_mark(s, start + nb - 1, 1);
+        }
+        if (!s->ram_writeback) {
+            return 0;
+        }
+    }
+
+    s->status |= SDHCI_DATA_INHIBIT;
+    s->discard_sector = start;
+    s->discard_nb = nb;
+    s->erase_next = start;
+    s->discard_acb = bdrv_aio_discard(s->bdrv, start, nb,
+        bcm2835_emmc_erase_done, s);
+    if (!s->discard_acb) {
+        bcm2835_emmc_erase_step(s);
+    }
+    return 0;
+}
+
+/* Handle a data command (or the CMD12 ending one) on the block path.
+ * Returns 1 with the R1 response filled in, 0 to leave the command to
+ * the card model, or -1 if it cannot be served at all: with the image
+ * held in memory, the card model would read and write a stale image.
+ */
+static int bcm2835_emmc_blk_command(bcm2835_emmc_state *s, uint8_t cmd,
+    uint8_t *response)
+{
+    uint32_t status;
+    uint64_t offset = 0;
+    int64_t sectors = 0;
+    int fallback = 0;
+
+    switch (cmd) {
+    case 12:
+        if (!s->blk_stop) {
+            return 0;
+        }
+        if (s->blk_read) {
+            // Drop whatever was fetched ahead
+            bcm2835_emmc_aio_stop(s);
+        } else if (s->blk_active && !bcm2835_emmc_busy(s)) {
+            // Commit the blocks written so far, DATA_END follows
+            bcm2835_emmc_fifo_flush(s);
+        }
+        s->blk_stop = 0;
+        s->blocks_left = 0;
+        break;
+    case 23:
+    case 32:
+    case 33:
+    case 38:
+        break;
+    case 17:
+    case 18:
+    case 24:
+    case 25:
+        // With the image in RAM the card model only has a stale view of
+        // it, so a data command the block path cannot take fails outright
+        fallback = s->ram ? -1 : 0;
+        if ((s->blksizecnt & 0x3ff) != BLK_SIZE) {
+            return fallback;
+        }
+        if (!s->bdrv || !bdrv_is_inserted(s->bdrv)) {
+            return fallback;
+        }
+        s->blk_read = (cmd == 17 || cmd == 18);
+        if (!s->blk_read && bdrv_is_read_only(s->bdrv)) {
+            return fallback;
+        }
+        offset = s->card_hc ? (uint64_t)s->arg1 << 9 : s->arg1;
+        sectors = bdrv_getlength(s->bdrv) >> 9;
+        if ((offset & (BLK_SIZE - 1)) || (offset >> 9) >= sectors) {
+            return fallback;
+        }
+        break;
+    default:
+        return 0;
+    }
 
-#define SDHCI_HOST_VERSION  0xFE
-#define  SDHCI_VENDOR_VER_MASK  0xFF00
-#define  SDHCI_VENDOR_VER_SHIFT 8
-#define  SDHCI_SPEC_VER_MASK    0x00FF
-#define  SDHCI_SPEC_VER_SHIFT   0
-#define   SDHCI_SPEC_100    0
-#define   SDHCI_SPEC_200    1
-#define   SDHCI_SPEC_300    2
+    if (!bcm2835_emmc_card_status(s, &status)
+        || SD_R1_STATE(status) != SD_STATE_TRAN) {
+        return fallback;
+    }
+    switch (cmd) {
+    case 32:
+        s->erase_start = s->card_hc ? s->arg1 : s->arg1 >> 9;
+        break;
+    case 33:
+        s->erase_end = s->card_hc ? s->arg1 : s->arg1 >> 9;
+        break;
+    case 38:
+        status |= bcm2835_emmc_erase(s);
+        if (!s->discard_acb) {
+            // Nothing to wait for, the busy phase is over already
+            s->interrupt |= SDHCI_INT_DATA_END;
+        }
+        break;
+    }
+    response[0] = status >> 24;
+    response[1] = status >> 16;
+    response[2] = status >> 8;
+    response[3] = status;
+    if (cmd == 12 || cmd == 32 || cmd == 33 || cmd == 38) {
+        return 1;
+    }
+    if (cmd == 23) {
+        // SET_BLOCK_COUNT, the card model has no idea about it
+        s->blk_preset = s->arg1;
+        return 1;
+    }
 
-/*
- * End of controller registers.
+    s->blk_active = 1;
+    s->blk_stop = (cmd == 18 || cmd == 25);
+    s->blk_sector = offset >> 9;
+    s->blk_pos = 0;
+    s->blksize = BLK_SIZE;
+    if (!s->blk_stop) {
+        s->blocks_left = 1;
+    } else if (s->cmd_preset) {
+        s->blocks_left = s->cmd_preset;
+    } else if (s->cmdtm & (SDHCI_TRNS_BLK_CNT_EN | SDHCI_TRNS_DMA)) {
+        s->blocks_left = s->blksizecnt >> 16;
+    } else {
+        // Open ended, until CMD12 or the end of the card
+        s->blocks_left = UINT32_MAX;
+    }
+    s->blk_sectors = sectors;
+    s->blocks_left = MIN(s->blocks_left, sectors - s->blk_sector);
+    s->fifo_pos = 0;
+    s->fifo_len = 0;
+    s->status |= SDHCI_DATA_INHIBIT;
+    bcm2835_emmc_throttle_cmd(s);
+    return 1;
+}
+
+static void bcm2835_emmc_data_end(bcm2835_emmc_state *s)
+{
+    bcm2835_emmc_auto_stop(s);
+    s->blocks_left = 0;
+    s->dma_paused = 0;
+    s->status &= ~SDHCI_DATA_INHIBIT;
+    s->interrupt |= SDHCI_INT_DATA_END;
+    if (!(s->cmdtm & SDHCI_TRNS_READ)
+        && ((s->cmdtm >> (16 + 8)) & 0x3f) == 24) {
+        s->write_op = 0;
+    }
+}
+
+static void bcm2835_emmc_adma_error(bcm2835_emmc_state *s, uint32_t state)
+{
+    s->adma_err = state;
+    s->blocks_left = 0;
+    s->adma_len = 0;
+    s->status &= ~SDHCI_DATA_INHIBIT;
+    s->interrupt |= SDHCI_INT_ADMA_ERROR | SDHCI_INT_ERROR;
+}
+
+/* SDMA: a single contiguous buffer at ARG2, which stops at every
+ * buffer boundary until the driver writes the next address back.
  */
-#define MMC_VDD_165_195     0x00000080  /* VDD voltage 1.65 - 1.95 */
-#define MMC_VDD_20_21       0x00000100  /* VDD voltage 2.0 ~ 2.1 */
-#define MMC_VDD_21_22       0x00000200  /* VDD voltage 2.1 ~ 2.2 */
-#define MMC_VDD_22_23       0x00000400  /* VDD voltage 2.2 ~ 2.3 */
-#define MMC_VDD_23_24       0x00000800  /* VDD voltage 2.3 ~ 2.4 */
-#define MMC_VDD_24_25       0x00001000  /* VDD voltage 2.4 ~ 2.5 */
-#define MMC_VDD_25_26       0x00002000  /* VDD voltage 2.5 ~ 2.6 */
-#define MMC_VDD_26_27       0x00004000  /* VDD voltage 2.6 ~ 2.7 */
-#define MMC_VDD_27_28       0x00008000  /* VDD voltage 2.7 ~ 2.8 */
-#define MMC_VDD_28_29       0x00010000  /* VDD voltage 2.8 ~ 2.9 */
-#define MMC_VDD_29_30       0x00020000  /* VDD voltage 2.9 ~ 3.0 */
-#define MMC_VDD_30_31       0x00040000  /* VDD voltage 3.0 ~ 3.1 */
-#define MMC_VDD_31_32       0x00080000  /* VDD voltage 3.1 ~ 3.2 */
-#define MMC_VDD_32_33       0x00100000  /* VDD voltage 3.2 ~ 3.3 */
-#define MMC_VDD_33_34       0x00200000  /* VDD voltage 3.3 ~ 3.4 */
-#define MMC_VDD_34_35       0x00400000  /* VDD voltage 3.4 ~ 3.5 */
-#define MMC_VDD_35_36       0x00800000  /* VDD voltage 3.5 ~ 3.6 */
+static void bcm2835_emmc_sdma_run(bcm2835_emmc_state *s)
+{
+    uint32_t boundary = 4096 << ((s->blksizecnt >> 12) & 0x7);
+    uint32_t n;
+
+    s->dma_paused = 0;
+    while (s->blocks_left > 0) {
+        n = bcm2835_emmc_dma_move(s, s->arg2,
+            boundary - (s->arg2 & (boundary - 1)));
+        s->arg2 += n;
+        if (n > 0 && s->blocks_left > 0
+            && (s->arg2 & (boundary - 1)) == 0) {
+            s->dma_paused = 1;
+            s->interrupt |= SDHCI_INT_DMA_END;
+            return;
+        }
+        if (bcm2835_emmc_busy(s)) {
+            return;
+        }
+    }
+    if (!bcm2835_emmc_busy(s)) {
+        bcm2835_emmc_data_end(s);
+    }
+}
 
-#define MMC_CAP_4_BIT_DATA  (1 << 0)    /* Can the host do 4 bit transfers */
-#define MMC_CAP_MMC_HIGHSPEED   (1 << 1)    /* Can do MMC high-speed timing */
-#define MMC_CAP_SD_HIGHSPEED    (1 << 2)    /* Can do SD high-speed timing */
-#define MMC_CAP_SDIO_IRQ    (1 << 3)    /* Can signal pending SDIO IRQs */
-#define MMC_CAP_SPI     (1 << 4)    /* Talks only SPI protocols */
-#define MMC_CAP_NEEDS_POLL  (1 << 5)    /* Needs polling for card-detection */
-#define MMC_CAP_8_BIT_DATA  (1 << 6)    /* Can the host do 8 bit transfers */
-#define MMC_CAP_DISABLE     (1 << 7)    /* Can the host be disabled */
-#define MMC_CAP_NONREMOVABLE    (1 << 8)    /* Nonremovable e.g. eMMC */
-#define MMC_CAP_WAIT_WHILE_BUSY (1 << 9)    /* Waits while card is busy */
-#define MMC_CAP_ERASE       (1 << 10)   /* Allow erase/trim commands */
-#define MMC_CAP_1_8V_DDR    (1 << 11)   /* can support */
-                        /* DDR mode at 1.8V */
-#define MMC_CAP_1_2V_DDR    (1 << 12)   /* can support */
-                        /* DDR mode at 1.2V */
-#define MMC_CAP_POWER_OFF_CARD  (1 << 13)   /* Can power off after boot */
-#define MMC_CAP_BUS_WIDTH_TEST  (1 << 14)   /* CMD14/CMD19 bus width ok */
-#define MMC_CAP_UHS_SDR12   (1 << 15)   /* Host supports UHS SDR12 mode */
-#define MMC_CAP_UHS_SDR25   (1 << 16)   /* Host supports UHS SDR25 mode */
-#define MMC_CAP_UHS_SDR50   (1 << 17)   /* Host supports UHS SDR50 mode */
-#define MMC_CAP_UHS_SDR104  (1 << 18)   /* Host supports UHS SDR104 mode */
-#define MMC_CAP_UHS_DDR50   (1 << 19)   /* Host supports UHS DDR50 mode */
-#define MMC_CAP_SET_XPC_330 (1 << 20)   /* Host supports >150mA current at 3.3V */
-#define MMC_CAP_SET_XPC_300 (1 << 21)   /* Host supports >150mA current at 3.0V */
-#define MMC_CAP_SET_XPC_180 (1 << 22)   /* Host supports >150mA current at 1.8V */
-#define MMC_CAP_DRIVER_TYPE_A   (1 << 23)   /* Host supports Driver Type A */
-#define MMC_CAP_DRIVER_TYPE_C   (1 << 24)   /* Host supports Driver Type C */
-#define MMC_CAP_DRIVER_TYPE_D   (1 << 25)   /* Host supports Driver Type D */
-#define MMC_CAP_MAX_CURRENT_200 (1 << 26)   /* Host max current limit is 200mA */
-#define MMC_CAP_MAX_CURRENT_400 (1 << 27)   /* Host max current limit is 400mA */
-#define MMC_CAP_MAX_CURRENT_600 (1 << 28)   /* Host max current limit is 600mA */
-#define MMC_CAP_MAX_CURRENT_800 (1 << 29)   /* Host max current limit is 800mA */
-#define MMC_CAP_CMD23       (1 << 30)   /* CMD23 supported. */
-#define MMC_CAP_HW_RESET    (1 << 31)   /* Hardware reset */
+/* ADMA2: walk the 32-bit descriptor table at SDHCI_ADMA_ADDRESS. The
+ * walk can stop in the middle of a transfer descriptor to wait for the
+ * block layer, adma_cur/adma_len keep what is left of it.
+ */
+static void bcm2835_emmc_adma_run(bcm2835_emmc_state *s)
+{
+    uint8_t desc[SDHCI_ADMA_DESC_SIZE];
+    uint32_t len, addr, n;
+
+    for (;;) {
+        if (s->adma_len > 0) {
+            n = bcm2835_emmc_dma_move(s, s->adma_cur, s->adma_len);
+            s->adma_cur += n;
+            s->adma_len -= n;
+            if (s->adma_len > 0 && s->blocks_left > 0) {
+                return;
+            }
+            s->adma_len = 0;
+            s->adma_addr += SDHCI_ADMA_DESC_SIZE;
+            if (s->adma_attr & SDHCI_ADMA_INT) {
+                s->interrupt |= SDHCI_INT_DMA_END;
+            }
+            if (s->adma_attr & SDHCI_ADMA_END) {
+                break;
+            }
+        }
+        if (s->blocks_left == 0) {
+            break;
+        }
 
+        if (s->adma_count++ == SDHCI_ADMA_MAX_DESC) {
+            bcm2835_emmc_adma_error(s, SDHCI_ADMA_ERR_ST_FDS);
+            return;
+        }
+        cpu_physical_memory_read(s->adma_addr, desc, sizeof(desc));
+        s->adma_attr = lduw_le_p(desc);
+        len = lduw_le_p(desc + 2);
+        addr = ldl_le_p(desc + 4);
+        if (len == 0) {
+            len = 65536;
+        }
 
-#define MMC_CAP2_BOOTPART_NOACC (1 << 0)    /* Boot partition no access */
-#define MMC_CAP2_CACHE_CTRL (1 << 1)    /* Allow cache control */
-#define MMC_CAP2_POWEROFF_NOTIFY (1 << 2)   /* Notify poweroff supported */
-#define MMC_CAP2_NO_MULTI_READ  (1 << 3)    /* Multiblock reads don't work */
-#define MMC_CAP2_FORCE_MULTIBLOCK (1 << 4)  /* Always use multiblock transfers */
+        if (!(s->adma_attr & SDHCI_ADMA_VALID)) {
+            bcm2835_emmc_adma_error(s, SDHCI_ADMA_ERR_ST_FDS);
+            return;
+        }
 
+        switch (s->adma_attr & SDHCI_ADMA_ACT_MASK) {
+        case SDHCI_ADMA_ACT_TRAN:
+            s->adma_cur = addr;
+            s->adma_len = len;
+            continue;
+        case SDHCI_ADMA_ACT_LINK:
+            s->adma_addr = addr;
+            break;
+        default:
+            s->adma_addr += SDHCI_ADMA_DESC_SIZE;
+            break;
+        }
 
-typedef struct {
-    SysBusDevice busdev;
-    MemoryRegion iomem;
+        if (s->adma_attr & SDHCI_ADMA_INT) {
+            s->interrupt |= SDHCI_INT_DMA_END;
+        }
+        if (s->adma_attr & SDHCI_ADMA_END) {
+            break;
+        }
+    }
 
-    SDState *card;
+    if (s->blocks_left > 0) {
+        // Descriptor table ended before the data did
+        bcm2835_emmc_adma_error(s, SDHCI_ADMA_ERR_ST_TFR | SDHCI_ADMA_ERR_LEN);
+        return;
+    }
+    if (!bcm2835_emmc_busy(s)) {
+        bcm2835_emmc_data_end(s);
+    }
+}
 
-    uint32_t arg2;
-    uint32_t blksizecnt;
-    uint32_t arg1;
-    uint32_t cmdtm;
-    uint32_t resp0;
-    uint32_t resp1;
-    uint32_t resp2;
-    uint32_t resp3;
-    uint32_t data;
-    uint32_t status;
-    uint32_t control0;
-    uint32_t control1;
-    uint32_t interrupt;
-    uint32_t irpt_mask;
-    uint32_t irpt_en;
-    uint32_t control2;
-    uint32_t force_irpt;
-    uint32_t spi_int_spt;
-    uint32_t slotisr_ver;
-    uint32_t caps;
-    uint32_t caps2;
-    uint32_t maxcurr;
-    uint32_t maxcurr2;
-    
-    int acmd;
-    int write_op;
-        
-    qemu_irq irq;
-    
-} bcm2835_emmc_state;
+static void bcm2835_emmc_dma_run(bcm2835_emmc_state *s)
+{
+    if ((s->control0 & SDHCI_CTRL_DMA_MASK) == SDHCI_CTRL_ADMA32) {
+        bcm2835_emmc_adma_run(s);
+    } else {
+        bcm2835_emmc_sdma_run(s);
+    }
+}
 
-static void bcm2835_emmc_set_irq(bcm2835_emmc_state *s) 
+/* Start the data phase of a command issued with the DMA bit set */
+static void bcm2835_emmc_dma_start(bcm2835_emmc_state *s)
 {
-    if (s->irpt_en & s->irpt_mask & s->interrupt) {
-        qemu_set_irq(s->irq, 1);
+    if (!s->blk_active) {
+        s->blksize = s->blksizecnt & 0x3ff;
+        if (s->cmd_preset) {
+            s->blocks_left = s->cmd_preset;
+        } else if (s->cmdtm & SDHCI_TRNS_MULTI) {
+            s->blocks_left = s->blksizecnt >> 16;
+        } else {
+            s->blocks_left = 1;
+        }
+        s->blk_pos = 0;
+        s->fifo_pos = 0;
+        s->fifo_len = 0;
+    }
+    if (s->blksize == 0 || s->blocks_left == 0) {
+        bcm2835_emmc_data_end(s);
+        return;
+    }
+
+    s->status |= SDHCI_DATA_INHIBIT;
+    s->adma_len = 0;
+    s->adma_count = 0;
+    bcm2835_emmc_dma_run(s);
+}
+
+/* Pick the data phase up again once the block layer is done */
+static void bcm2835_emmc_data_resume(bcm2835_emmc_state *s)
+{
+    if (s->cmdtm & SDHCI_TRNS_DMA) {
+        if (!s->dma_paused) {
+            bcm2835_emmc_dma_run(s);
+        }
     } else {
-        qemu_set_irq(s->irq, 0);
+        bcm2835_emmc_pio_update(s);
     }
+    bcm2835_emmc_set_irq(s);
+    bcm2835_emmc_update_dreq(s);
 }
 
 static uint64_t bcm2835_emmc_read(void *opaque, hwaddr offset,
@@ -370,21 +2412,35 @@ static uint64_t bcm2835_emmc_read(void *opaque, hwaddr offset,
         res = s->resp3;
         break;
     case SDHCI_BUFFER:          // DATA
+        s->stats.port_reads++;
+        if (s->blk_active) {
+            s->data = bcm2835_emmc_pio_read(s);
+            res = s->data;
+            break;
+        }
         s->data = 0;
-        tmp = sd_read_data(s->card);
+        tmp = bcm2835_emmc_card_read(s);
         s->data |= (tmp << 0);
-        tmp = sd_read_data(s->card);
+        tmp = bcm2835_emmc_card_read(s);
         s->data |= (tmp << 8);
-        tmp = sd_read_data(s->card);
+        tmp = bcm2835_emmc_card_read(s);
         s->data |= (tmp << 16);
-        tmp = sd_read_data(s->card);
+        tmp = bcm2835_emmc_card_read(s);
         s->data |= (tmp << 24);
-        if (sd_data_ready(s->card)) {
+        if ((s->blksizecnt & 0x3ff)
+            && s->data_count % (s->blksizecnt & 0x3ff) == 0) {
+            s->stats.blocks_read++;
+        }
+        if (s->stop_pending && s->data_count >= s->data_total) {
+            bcm2835_emmc_auto_stop(s);
+            s->interrupt |= SDHCI_INT_DATA_END;
+        } else if (sd_data_ready(s->card)) {
             s->interrupt |= SDHCI_INT_DATA_AVAIL;
         } else {
             s->interrupt |= SDHCI_INT_DATA_END;
         }
         bcm2835_emmc_set_irq(s);
+        bcm2835_emmc_update_dreq(s);
 
         res = s->data;
         break;
@@ -410,7 +2466,7 @@ static uint64_t bcm2835_emmc_read(void *opaque, hwaddr offset,
         res = s->caps;
         break;
     case SDHCI_CAPABILITIES_1:
-        res = s->caps;
+        res = s->caps2;
         break;        
     case SDHCI_ACMD12_ERR:      // CONTROL2
         res = s->control2;
@@ -427,6 +2483,12 @@ static uint64_t bcm2835_emmc_read(void *opaque, hwaddr offset,
     case SDHCI_MAX_CURRENT+4:
         res = s->maxcurr2;
         break;
+    case SDHCI_ADMA_ERROR:
+        res = s->adma_err;
+        break;
+    case SDHCI_ADMA_ADDRESS:
+        res = s->adma_addr;
+        break;
     default:
         break;
     }
@@ -442,12 +2504,18 @@ static void bcm2835_emmc_write(void *opaque, hwaddr offset,
     SDRequest request;
     uint8_t response[16];
     int resplen;
+    int blk;
     
     assert(size == 4);
     
     switch(offset) {
     case SDHCI_ARGUMENT2:      // ARG2
         s->arg2 = value;
+        if (s->dma_paused) {
+            // Next SDMA buffer, resume the transfer
+            bcm2835_emmc_sdma_run(s);
+            bcm2835_emmc_set_irq(s);
+        }
         break;
     case SDHCI_BLOCK_SIZE:     // BLKSIZECNT
         s->blksizecnt = value;
@@ -458,12 +2526,63 @@ static void bcm2835_emmc_write(void *opaque, hwaddr offset,
     case SDHCI_TRANSFER_MODE:   // CMDTM
         s->cmdtm = value;    
         cmd = ((value >> (16 + 8)) & 0x3f);
+        s->data_count = 0;
+        s->data_cmd = s->acmd ? SD_ACMD(cmd) : cmd;
+        s->stop_pending = 0;
+
+        if (s->acmd) {
+            s->stats.acmds[cmd]++;
+        } else {
+            s->stats.cmds[cmd]++;
+        }
+        trace_bcm2835_emmc_cmd(s, cmd, s->acmd, s->arg1);
+        s->lat_start = qemu_get_clock_ns(rt_clock);
+        s->lat_wait = ((value >> 16) & SDHCI_CMD_DATA)
+            || ((value >> 16) & SDHCI_CMD_RESP_MASK)
+                == SDHCI_CMD_RESP_SHORT_BUSY;
+        if (!s->lat_wait) {
+            s->lat_class = LAT_OTHER;
+        } else if (value & SDHCI_TRNS_READ) {
+            s->lat_class = LAT_READ;
+        } else if ((value >> 16) & SDHCI_CMD_DATA) {
+            s->lat_class = LAT_WRITE;
+        } else {
+            s->lat_class = LAT_OTHER;
+        }
+
+        // A block count set with CMD23, or by the controller (Auto CMD23)
+        s->cmd_preset = 0;
+        if (!s->acmd && (cmd == 18 || cmd == 25)) {
+            if (value & SDHCI_TRNS_AUTO_CMD23) {
+                s->cmd_preset = s->arg2;
+            } else {
+                s->cmd_preset = s->blk_preset;
+            }
+        }
+        s->blk_preset = 0;
         
         request.cmd = cmd;
         request.arg = s->arg1;
         request.crc = 0;
-        
-        resplen = sd_do_command(s->card, &request, response);
+
+        if (s->acmd || cmd != 12) {
+            // Any other command ends the data phase of the last one
+            bcm2835_emmc_aio_stop(s);
+            s->blk_active = 0;
+        }
+        blk = s->acmd ? 0 : bcm2835_emmc_blk_command(s, cmd, response);
+        if (blk > 0) {
+            resplen = 4;
+        } else if (blk < 0) {
+            resplen = 0;
+        } else {
+            if (!s->acmd && (cmd == 24 || cmd == 25)) {
+                // Written behind the block path's back
+                bcm2835_emmc_ra_invalidate(s, 0, INT64_MAX);
+                bcm2835_emmc_zero_clear(s, 0, INT64_MAX);
+            }
+            resplen = sd_do_command(s->card, &request, response);
+        }
         
         if (resplen > 0) {
             if (resplen == 4) {
@@ -473,6 +2592,7 @@ static void bcm2835_emmc_write(void *opaque, hwaddr offset,
                     | (response[3] << 0);
                 if (!s->acmd && ( (cmd == 24) || (cmd == 25) ) ) {
                     s->interrupt |= SDHCI_INT_SPACE_AVAIL;
+                    s->write_op = 1;
                 }
             } else if (resplen == 16) {
                 s->resp3 = 0
@@ -496,14 +2616,33 @@ static void bcm2835_emmc_write(void *opaque, hwaddr offset,
                     | (response[3+12-1] << 0);
             }
             
+            if (!s->acmd && (cmd == 3)) {
+                s->rca = s->resp0 >> 16;
+            }
+            if (s->acmd && (cmd == 41) && (s->resp0 & SD_OCR_BUSY)) {
+                s->card_hc = !!(s->resp0 & SD_OCR_CCS);
+            }
+
+            if (!s->acmd && (cmd == 18 || cmd == 25)
+                && (s->cmd_preset || (value & SDHCI_TRNS_AUTO_CMD12))) {
+                s->stop_pending = 1;
+                s->data_total = (s->blksizecnt & 0x3ff) * (s->cmd_preset
+                    ? s->cmd_preset : (s->blksizecnt >> 16));
+            }
+
             s->interrupt |= SDHCI_INT_RESPONSE;
             
             if (!s->acmd && (cmd == 12)) {
                 // Stop transmission
                 s->interrupt &= ~SDHCI_INT_SPACE_AVAIL;
-                s->interrupt |= SDHCI_INT_DATA_END;
+                if (!bcm2835_emmc_busy(s)) {
+                    // Otherwise the last blocks land first
+                    s->status &= ~SDHCI_DATA_INHIBIT;
+                    s->interrupt |= SDHCI_INT_DATA_END;
+                    s->write_op = 0;
+                }
             } else {
-                if (sd_data_ready(s->card)) {
+                if (bcm2835_emmc_data_ready(s)) {
                     s->interrupt |= SDHCI_INT_DATA_AVAIL;
                 }
             }
@@ -516,45 +2655,99 @@ static void bcm2835_emmc_write(void *opaque, hwaddr offset,
                 s->interrupt |= SDHCI_INT_TIMEOUT;
                 s->interrupt |= SDHCI_INT_ERROR;
             }
+            if (blk < 0) {
+                s->interrupt |= SDHCI_INT_TIMEOUT;
+                s->interrupt |= SDHCI_INT_ERROR;
+            }
             if (!s->acmd && (cmd == 0)) {
                 s->interrupt |= SDHCI_INT_RESPONSE;
+                s->rca = 0;
+                s->card_hc = 0;
+                s->blk_stop = 0;
             }
             bcm2835_emmc_set_irq(s);
         }
+        if ((value & SDHCI_TRNS_DMA) && ((value >> 16) & SDHCI_CMD_DATA)
+            && resplen > 0) {
+            bcm2835_emmc_dma_start(s);
+            s->interrupt &= ~(SDHCI_INT_DATA_AVAIL | SDHCI_INT_SPACE_AVAIL);
+            bcm2835_emmc_set_irq(s);
+        } else if (s->blk_active && resplen > 0 && cmd != 12) {
+            bcm2835_emmc_pio_update(s);
+            bcm2835_emmc_set_irq(s);
+        }
         if (cmd == 55) {
             s->acmd = 1;
         } else {
             s->acmd = 0;
         }
+        if (s->lat_start && !s->lat_wait) {
+            bcm2835_emmc_lat_end(s);
+        }
+        bcm2835_emmc_update_dreq(s);
         break;
     case SDHCI_BUFFER:          // DATA
         s->data = value;
+        s->stats.port_writes++;
+        if (s->blk_active) {
+            bcm2835_emmc_pio_write(s, value);
+            break;
+        }
 
         sd_write_data(s->card, (value >> 0) & 0xff);
         sd_write_data(s->card, (value >> 8) & 0xff);
         sd_write_data(s->card, (value >> 16) & 0xff);
         sd_write_data(s->card, (value >> 24) & 0xff);
 
-        s->interrupt |= SDHCI_INT_SPACE_AVAIL;
+        // A single block write is over once the whole block went through
+        s->data_count += 4;
+        if ((s->blksizecnt & 0x3ff)
+            && s->data_count % (s->blksizecnt & 0x3ff) == 0) {
+            s->stats.blocks_written++;
+        }
+        if (((s->cmdtm >> (16 + 8)) & 0x3f) == 24
+            && s->data_count >= (s->blksizecnt & 0x3ff)) {
+            s->write_op = 0;
+        }
+        if (s->stop_pending && s->data_count >= s->data_total) {
+            bcm2835_emmc_auto_stop(s);
+            s->interrupt |= SDHCI_INT_DATA_END;
+            s->write_op = 0;
+            bcm2835_emmc_set_irq(s);
+        } else {
+            s->interrupt |= SDHCI_INT_SPACE_AVAIL;
+        }
+        bcm2835_emmc_update_dreq(s);
 
         break;
     case SDHCI_HOST_CONTROL:    // CONTROL0
-        s->control0 &= ~0x007f0026;
-        value &= 0x007f0026;
+        s->control0 &= ~0x007f003e;
+        value &= 0x007f003e;
         s->control0 |= value;
         break;
     case SDHCI_CLOCK_CONTROL:  // CONTROL1
-        s->control0 &= ~0x070fffe7;
+        s->control1 &= ~0x070fffe7;
         value &= 0x070fffe7;
         if ( value & ((SDHCI_RESET_ALL 
             | SDHCI_RESET_CMD 
             | SDHCI_RESET_DATA) << 24) ) {
             // Reset
+            if (value & ((SDHCI_RESET_ALL | SDHCI_RESET_DATA) << 24)) {
+                bcm2835_emmc_aio_stop(s);
+                s->blocks_left = 0;
+                s->dma_paused = 0;
+                s->adma_len = 0;
+                s->blk_active = 0;
+                s->blk_pos = 0;
+                s->fifo_pos = 0;
+                s->fifo_len = 0;
+                s->status &= ~SDHCI_DATA_INHIBIT;
+            }
             value &= ~((SDHCI_RESET_ALL 
                 | SDHCI_RESET_CMD 
                 | SDHCI_RESET_DATA) << 24);
         }
-        s->control1 |= value;
+        s->control1 |= value | SDHCI_CLOCK_INT_STABLE;
         break;
     case SDHCI_INT_STATUS:      // INTERRUPT
         s->interrupt &= ~value;
@@ -575,6 +2768,9 @@ static void bcm2835_emmc_write(void *opaque, hwaddr offset,
     case SDHCI_SET_ACMD12_ERROR:    // FORCE_IRPT
         s->force_irpt = value;
         break;        
+    case SDHCI_ADMA_ADDRESS:
+        s->adma_addr = value;
+        break;
 
     default:
         break;
@@ -597,18 +2793,89 @@ static const VMStateDescription vmstate_bcm2835_emmc = {
     }
 };
 
+static void bcm2835_emmc_get_ra_hits(Object *obj, Visitor *v,
+    void *opaque, const char *name, Error **errp)
+{
+    bcm2835_emmc_state *s = (bcm2835_emmc_state *)opaque;
+
+    visit_type_uint64(v, &s->ra_hits, name, errp);
+}
+
+static void bcm2835_emmc_get_ra_misses(Object *obj, Visitor *v,
+    void *opaque, const char *name, Error **errp)
+{
+    bcm2835_emmc_state *s = (bcm2835_emmc_state *)opaque;
+
+    visit_type_uint64(v, &s->ra_misses, name, errp);
+}
+
+static void bcm2835_emmc_visit_counts(Visitor *v, uint64_t *counts,
+    const char *prefix, const char *name, Error **errp)
+{
+    char key[16];
+    int n;
+
+    visit_start_struct(v, NULL, NULL, name, 0, errp);
+    for (n = 0; n < 64; n++) {
+        snprintf(key, sizeof(key), "%s%d", prefix, n);
+        visit_type_uint64(v, &counts[n], key, errp);
+    }
+    visit_end_struct(v, errp);
+}
+
+static void bcm2835_emmc_get_stats(Object *obj, Visitor *v,
+    void *opaque, const char *name, Error **errp)
+{
+    bcm2835_emmc_state *s = (bcm2835_emmc_state *)opaque;
+    emmcstats *st = &s->stats;
+
+    visit_start_struct(v, NULL, NULL, name, 0, errp);
+    bcm2835_emmc_visit_counts(v, st->cmds, "cmd", "cmds", errp);
+    bcm2835_emmc_visit_counts(v, st->acmds, "acmd", "acmds", errp);
+    visit_type_uint64(v, &st->blocks_read, "blocks-read", errp);
+    visit_type_uint64(v, &st->blocks_written, "blocks-written", errp);
+    visit_type_uint64(v, &st->port_reads, "data-port-reads", errp);
+    visit_type_uint64(v, &st->port_writes, "data-port-writes", errp);
+    visit_type_uint64(v, &st->irqs, "irqs", errp);
+    visit_type_uint64(v, &st->zero_blocks, "zero-blocks", errp);
+    visit_type_uint64(v, &st->prof_hits, "boot-profile-hits", errp);
+    visit_type_uint64(v, &st->prof_misses, "boot-profile-misses", errp);
+    bcm2835_visit_hist(v, &st->latency[LAT_READ], "read-latency-ns", errp);
+    bcm2835_visit_hist(v, &st->latency[LAT_WRITE], "write-latency-ns", errp);
+    bcm2835_visit_hist(v, &st->latency[LAT_OTHER], "other-latency-ns", errp);
+    visit_end_struct(v, errp);
+}
+
+static void bcm2835_emmc_set_stats_reset(Object *obj, Visitor *v,
+    void *opaque, const char *name, Error **errp)
+{
+    bcm2835_emmc_state *s = (bcm2835_emmc_state *)opaque;
+    bool value = false;
+
+    visit_type_bool(v, &value, name, errp);
+    if (!value) {
+        return;
+    }
+    memset(&s->stats, 0, sizeof(emmcstats));
+    s->ra_hits = 0;
+    s->ra_misses = 0;
+}
+
 static int bcm2835_emmc_init(SysBusDevice *dev)
 {
     bcm2835_emmc_state *s = FROM_SYSBUS(bcm2835_emmc_state, dev);
     
     DriveInfo *di;
+    int n;
     
-    di = drive_get(IF_SD, 0, 0);
+    di = drive_get(IF_SD, 0, s->drive_index);
     if (!di) {
         fprintf(stderr, "bcm2835_emmc: missing SD card\n");
         exit(1);
     }
     s->card = sd_init(di->bdrv, 0);
+    s->bdrv = di->bdrv;
+    s->fifo = qemu_blockalign(s->bdrv, BLK_BUF_SIZE);
     
     s->arg2 = 0;
     s->blksizecnt = 0;
@@ -629,13 +2896,123 @@ static int bcm2835_emmc_init(SysBusDevice *dev)
     s->force_irpt = 0;
     s->spi_int_spt = 0;
     s->slotisr_ver = (0x9900 | SDHCI_SPEC_300) << 16;
-    s->caps = 0;
+    s->caps = SDHCI_CAN_DO_SDMA | SDHCI_CAN_DO_ADMA2;
     s->caps2 = 0;
     s->maxcurr = 1;
     s->maxcurr2 = 0;
     
     s->acmd = 0;
     s->write_op = 0;
+    s->data_count = 0;
+    s->data_total = 0;
+    s->data_cmd = 0;
+    s->blk_preset = 0;
+    s->cmd_preset = 0;
+    s->stop_pending = 0;
+    s->erase_start = -1;
+    s->erase_end = -1;
+    s->thr_bps_next = 0;
+    s->thr_iops_next = 0;
+    s->throttled = 0;
+    s->thr_flush_pending = 0;
+    s->thr_timer = qemu_new_timer_ns(vm_clock, bcm2835_emmc_throttle_tick, s);
+
+    memset(&s->stats, 0, sizeof(emmcstats));
+    s->irq_level = 0;
+    s->lat_start = 0;
+    s->lat_class = LAT_OTHER;
+    s->lat_wait = 0;
+
+    s->adma_err = 0;
+    s->adma_addr = 0;
+    s->blksize = 0;
+    s->blocks_left = 0;
+    s->dma_paused = 0;
+    s->fifo_pos = 0;
+    s->fifo_len = 0;
+
+    s->rca = 0;
+    s->card_hc = 0;
+    s->blk_active = 0;
+    s->blk_read = 0;
+    s->blk_stop = 0;
+    s->blk_sector = 0;
+    s->blk_pos = 0;
+    s->aiocb = NULL;
+    s->aio_cancel = 0;
+    s->discard_acb = NULL;
+    s->adma_attr = 0;
+    s->adma_cur = 0;
+    s->adma_len = 0;
+    s->adma_count = 0;
+
+    // Two windows in flight at most, both within the memory cap
+    s->ra_window = MIN(s->ra_blocks,
+        s->ra_max_bytes / (RA_WINDOWS * BLK_SIZE));
+    s->blk_sectors = 0;
+    s->ram = NULL;
+    if (s->ram_image && bdrv_is_inserted(s->bdrv)) {
+        bcm2835_emmc_ram_load(s);
+        s->ra_window = 0;
+    }
+    for (n = 0; n < RA_WINDOWS; n++) {
+        s->ra[n].emmc = s;
+        s->ra[n].buf = NULL;
+        if (s->ra_window > 0) {
+            s->ra[n].buf = qemu_blockalign(s->bdrv, s->ra_window * BLK_SIZE);
+        }
+        s->ra[n].count = 0;
+        s->ra[n].stale = 0;
+        s->ra[n].aiocb = NULL;
+    }
+    s->ra_wait = NULL;
+    s->ra_next = -1;
+    s->ra_hits = 0;
+    s->ra_misses = 0;
+
+    s->zero_map = NULL;
+    s->zero_chunks = 0;
+    s->zero_sectors = 0;
+    s->discard_sector = 0;
+    s->discard_nb = 0;
+    s->erase_next = 0;
+    s->erase_zeros = NULL;
+    if (s->zero_map_enable && !s->ram && bdrv_is_inserted(s->bdrv)) {
+        s->zero_sectors = bdrv_getlength(s->bdrv) >> 9;
+        s->zero_chunks = DIV_ROUND_UP(s->zero_sectors, ZERO_CHUNK_SECTORS);
+        s->zero_map = bitmap_new(s->zero_chunks);
+        bcm2835_emmc_zero_scan(s, 0, s->zero_sectors);
+    }
+
+    s->prof_sectors = 0;
+    s->prof_recording = 0;
+    s->prof_hash = 0;
+    s->prof_hashed = 0;
+    s->prof_hash_end = 0;
+    s->prof_fill_pos = -1;
+    s->prof_rec_blocks = 0;
+    s->prof_rec = NULL;
+    s->prof_nrec = 0;
+    s->prof_rec_alloc = 0;
+    s->prof_chunks = NULL;
+    s->prof_nchunks = 0;
+    s->prof_next = 0;
+    s->prof_bytes = 0;
+    s->prof_cache = NULL;
+    s->prof_runs = NULL;
+    s->prof_bufs = NULL;
+    if (s->prof_path && !s->ram && bdrv_is_inserted(s->bdrv)) {
+        // Replay the last boot while recording this one
+        s->prof_sectors = bdrv_getlength(s->bdrv) >> 9;
+        bcm2835_emmc_prof_load(s);
+        s->prof_recording = 1;
+        s->prof_hash = bcm2835_emmc_prof_hash_start(s);
+        s->prof_timer = qemu_new_timer_ms(vm_clock,
+            bcm2835_emmc_prof_tick, s);
+        qemu_mod_timer(s->prof_timer, qemu_get_clock_ms(vm_clock)
+            + s->prof_seconds * 1000LL);
+        qemu_add_vm_change_state_handler(bcm2835_emmc_prof_vm_state, s);
+    }
     
     memory_region_init_io(&s->iomem, &bcm2835_emmc_ops, s, 
         "bcm2835_emmc", 0x100000);
@@ -643,15 +3020,50 @@ static int bcm2835_emmc_init(SysBusDevice *dev)
     vmstate_register(&dev->qdev, -1, &vmstate_bcm2835_emmc, s);
 
     sysbus_init_irq(dev, &s->irq);
+    sysbus_init_irq(dev, &s->dreq);
+
+    object_property_add(OBJECT(dev), "readahead-hits", "uint64",
+        bcm2835_emmc_get_ra_hits, NULL, NULL, s, NULL);
+    object_property_add(OBJECT(dev), "readahead-misses", "uint64",
+        bcm2835_emmc_get_ra_misses, NULL, NULL, s, NULL);
+    object_property_add(OBJECT(dev), "stats", "bcm2835-emmc-stats",
+        bcm2835_emmc_get_stats, NULL, NULL, s, NULL);
+    object_property_add(OBJECT(dev), "stats-reset", "bool",
+        NULL, bcm2835_emmc_set_stats_reset, NULL, s, NULL);
 
     return 0;
 }
 
+static Property bcm2835_emmc_properties[] = {
+    DEFINE_PROP_UINT32("drive-index", bcm2835_emmc_state, drive_index, 0),
+    DEFINE_PROP_UINT32("readahead", bcm2835_emmc_state, ra_blocks, 0),
+    DEFINE_PROP_UINT32("readahead-max-bytes", bcm2835_emmc_state,
+        ra_max_bytes, 1 << 20),
+    DEFINE_PROP_UINT32("ram-image", bcm2835_emmc_state, ram_image, 0),
+    DEFINE_PROP_UINT32("ram-writeback", bcm2835_emmc_state,
+        ram_writeback, 1),
+    DEFINE_PROP_UINT32("ram-flush-ms", bcm2835_emmc_state,
+        ram_flush_ms, 100),
+    DEFINE_PROP_UINT32("throttle-bps", bcm2835_emmc_state, thr_bps, 0),
+    DEFINE_PROP_UINT32("throttle-iops", bcm2835_emmc_state, thr_iops, 0),
+    DEFINE_PROP_UINT32("throttle-follow-clock", bcm2835_emmc_state,
+        thr_follow_clock, 0),
+    DEFINE_PROP_UINT32("zero-map", bcm2835_emmc_state, zero_map_enable, 0),
+    DEFINE_PROP_STRING("boot-profile", bcm2835_emmc_state, prof_path),
+    DEFINE_PROP_UINT32("boot-profile-seconds", bcm2835_emmc_state,
+        prof_seconds, 60),
+    DEFINE_PROP_UINT32("boot-profile-max-bytes", bcm2835_emmc_state,
+        prof_max_bytes, 64 << 20),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
 static void bcm2835_emmc_class_init(ObjectClass *klass, void *data)
 {
+    DeviceClass *dc = DEVICE_CLASS(klass);
     SysBusDeviceClass *sdc = SYS_BUS_DEVICE_CLASS(klass);
 
     sdc->init = bcm2835_emmc_init;
+    dc->props = bcm2835_emmc_properties;
 }
 
 static TypeInfo bcm2835_emmc_info = {
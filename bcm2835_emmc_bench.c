@@ -0,0 +1,316 @@
+/*
+ * Raspberry Pi emulation (c) 2012 Gregory Estrade
+ * This code is licensed under the GNU GPLv2 and later.
+ */
+
+/* Standalone microbenchmark for the bcm2835_emmc data path: PIO reads
+ * of the data port through the card model a byte at a time, as it was,
+ * against the block-granular FIFO path. Both paths are modelled on the
+ * code they stand for (sd.c's sd_read_data() for CMD18 and the
+ * SDHCI_BUFFER read of bcm2835_emmc.c), minus the block layer: a
+ * bdrv_read() is a memcpy() from an in-memory image here, which only
+ * flatters the byte path since it issues one request per block.
+ *
+ * Not part of the device, build it on its own:
+ *   gcc -O2 -o emmc_bench bcm2835_emmc_bench.c
+ *   ./emmc_bench [megabytes]
+ *
+ * Host instructions are counted with perf_event_open() where the kernel
+ * allows it, otherwise only time is reported.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+#define BLK_SIZE        512
+#define BLK_BUF_BLOCKS  64
+#define BLK_BUF_SIZE    (BLK_SIZE * BLK_BUF_BLOCKS)
+
+#define INT_DATA_AVAIL  (1 << 5)
+#define INT_DATA_END    (1 << 1)
+
+#define NOINLINE __attribute__((noinline))
+
+static uint8_t *image;
+static uint32_t image_blocks;
+
+/* bdrv_read() stand-in */
+static NOINLINE int bench_bdrv_read(uint32_t sector, uint8_t *buf, int n)
+{
+    memcpy(buf, image + (size_t)sector * BLK_SIZE, (size_t)n * BLK_SIZE);
+    return 0;
+}
+
+/* Card side of the byte path, after sd.c */
+typedef struct {
+    int state;              /* 1 while sending data */
+    int enable;
+    uint32_t card_status;
+    uint32_t ocr;
+    int current_cmd;
+    uint32_t blk_len;
+    uint64_t data_start;
+    uint32_t data_offset;
+    uint8_t data[BLK_SIZE];
+    uint8_t buf[BLK_SIZE];
+} bench_card;
+
+static NOINLINE uint8_t bench_sd_read_data(bench_card *sd)
+{
+    uint8_t ret;
+    uint32_t io_len;
+
+    if (!sd->enable || sd->state != 1 || (sd->card_status & 0x80000000)) {
+        return 0;
+    }
+    io_len = (sd->ocr & (1 << 30)) ? BLK_SIZE : sd->blk_len;
+    switch (sd->current_cmd) {
+    case 18:
+        if (sd->data_offset == 0) {
+            bench_bdrv_read(sd->data_start >> 9, sd->buf, 1);
+            memcpy(sd->data, sd->buf + (sd->data_start & 511), io_len);
+        }
+        ret = sd->data[sd->data_offset++];
+        if (sd->data_offset >= io_len) {
+            sd->data_start += io_len;
+            sd->data_offset = 0;
+            if (sd->data_start + io_len > (uint64_t)image_blocks * BLK_SIZE) {
+                sd->card_status |= 0x80000000;
+            }
+        }
+        break;
+    default:
+        ret = 0;
+        break;
+    }
+    return ret;
+}
+
+static NOINLINE int bench_sd_data_ready(bench_card *sd)
+{
+    return sd->state == 1;
+}
+
+/* Controller side, common to both paths */
+typedef struct {
+    bench_card card;
+    uint32_t interrupt;
+    uint32_t irpt_mask;
+    uint32_t blksize;
+    uint32_t data_count;
+    int data_cmd;
+    uint64_t blocks_read;
+    int irq;
+
+    uint8_t fifo[BLK_BUF_SIZE];
+    uint32_t fifo_pos, fifo_len, blk_pos;
+    uint32_t blocks_left;
+    uint32_t blk_sector;
+} bench_emmc;
+
+static NOINLINE void bench_set_irq(bench_emmc *s)
+{
+    s->irq = (s->interrupt & s->irpt_mask) != 0;
+}
+
+/* Byte path: bcm2835_emmc_card_read() plus the old SDHCI_BUFFER read */
+static uint8_t bench_card_read(bench_emmc *s)
+{
+    uint8_t value = bench_sd_read_data(&s->card);
+
+    if (s->data_cmd == 51 && s->data_count == 3) {
+        value |= 0x02;
+    }
+    s->data_count++;
+    return value;
+}
+
+static NOINLINE uint32_t bench_read_bytewise(bench_emmc *s)
+{
+    uint32_t data = 0;
+
+    data |= bench_card_read(s) << 0;
+    data |= bench_card_read(s) << 8;
+    data |= bench_card_read(s) << 16;
+    data |= (uint32_t)bench_card_read(s) << 24;
+    if (s->data_count % s->blksize == 0) {
+        s->blocks_read++;
+    }
+    if (bench_sd_data_ready(&s->card)) {
+        s->interrupt |= INT_DATA_AVAIL;
+    } else {
+        s->interrupt |= INT_DATA_END;
+    }
+    bench_set_irq(s);
+    return data;
+}
+
+/* Block path: bcm2835_emmc_fifo_fill/get/advance and pio_read */
+static void bench_fifo_fill(bench_emmc *s)
+{
+    uint32_t n = s->blocks_left < BLK_BUF_BLOCKS
+        ? s->blocks_left : BLK_BUF_BLOCKS;
+
+    bench_bdrv_read(s->blk_sector, s->fifo, n);
+    s->blk_sector += n;
+    s->fifo_pos = 0;
+    s->fifo_len = n * BLK_SIZE;
+}
+
+static NOINLINE uint32_t bench_read_block(bench_emmc *s)
+{
+    uint32_t data;
+
+    if (s->fifo_pos == s->fifo_len) {
+        bench_fifo_fill(s);
+    }
+    memcpy(&data, s->fifo + s->fifo_pos, 4);
+    s->fifo_pos += 4;
+    s->blk_pos += 4;
+    if (s->blk_pos == s->blksize) {
+        // Interrupt status only changes at block boundaries
+        s->blk_pos = 0;
+        s->blocks_left--;
+        s->blocks_read++;
+        s->interrupt |= s->blocks_left ? INT_DATA_AVAIL : INT_DATA_END;
+        bench_set_irq(s);
+    }
+    return data;
+}
+
+static void bench_start(bench_emmc *s, uint32_t blocks)
+{
+    memset(s, 0, sizeof(*s));
+    s->card.enable = 1;
+    s->card.state = 1;
+    s->card.ocr = 1 << 30;
+    s->card.current_cmd = 18;
+    s->card.blk_len = BLK_SIZE;
+    s->blksize = BLK_SIZE;
+    s->data_cmd = 18;
+    s->irpt_mask = ~0;
+    s->blocks_left = blocks;
+}
+
+static int perf_fd = -1;
+
+static void counter_open(void)
+{
+#ifdef __linux__
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    perf_fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+#endif
+}
+
+static void counter_start(void)
+{
+#ifdef __linux__
+    if (perf_fd >= 0) {
+        ioctl(perf_fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(perf_fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+#endif
+}
+
+static uint64_t counter_stop(void)
+{
+    uint64_t count = 0;
+
+#ifdef __linux__
+    if (perf_fd >= 0) {
+        ioctl(perf_fd, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(perf_fd, &count, sizeof(count)) != sizeof(count)) {
+            count = 0;
+        }
+    }
+#endif
+    return count;
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void report(const char *name, uint64_t bytes, uint64_t insns,
+    uint64_t ns, uint32_t sum)
+{
+    printf("%-10s %8.3f bytes/ns", name, (double)bytes / ns);
+    if (insns) {
+        printf("  %8.4f bytes/insn", (double)bytes / insns);
+    }
+    printf("  (checksum %08x)\n", sum);
+}
+
+int main(int argc, char **argv)
+{
+    static bench_emmc s;
+    uint32_t mb = argc > 1 ? atoi(argv[1]) : 64;
+    uint64_t bytes, insns, t;
+    uint32_t words, i, sum;
+
+    if (mb == 0) {
+        mb = 64;
+    }
+    image_blocks = mb * 2048;
+    bytes = (uint64_t)image_blocks * BLK_SIZE;
+    image = malloc(bytes);
+    if (!image) {
+        perror("malloc");
+        return 1;
+    }
+    for (i = 0; i < bytes / 4; i++) {
+        ((uint32_t *)image)[i] = i * 2654435761u;
+    }
+    words = bytes / 4;
+
+    counter_open();
+    if (perf_fd < 0) {
+        printf("no instruction counter, reporting time only\n");
+    }
+
+    bench_start(&s, image_blocks);
+    sum = 0;
+    counter_start();
+    t = now_ns();
+    for (i = 0; i < words; i++) {
+        sum += bench_read_bytewise(&s);
+    }
+    t = now_ns() - t;
+    insns = counter_stop();
+    report("bytewise", bytes, insns, t, sum);
+
+    bench_start(&s, image_blocks);
+    sum = 0;
+    counter_start();
+    t = now_ns();
+    for (i = 0; i < words; i++) {
+        sum += bench_read_block(&s);
+    }
+    t = now_ns() - t;
+    insns = counter_stop();
+    report("block", bytes, insns, t, sum);
+
+    free(image);
+    return 0;
+}
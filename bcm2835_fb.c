@@ -36,19 +36,56 @@
 #include "ui/pixel_ops.h"
 
 #include "exec/cpu-common.h"
+#include "qapi/visitor.h"
+#include "qemu/timer.h"
 
 #include "bcm2835_common.h"
+#include "bcm2835_fb_simd.h"
 
 #define BITS 8
-#include "milkymist-vgafb_template.h"
+#include "bcm2835_fb_template.h"
 #define BITS 15
-#include "milkymist-vgafb_template.h"
+#include "bcm2835_fb_template.h"
 #define BITS 16
-#include "milkymist-vgafb_template.h"
+#include "bcm2835_fb_template.h"
 #define BITS 24
-#include "milkymist-vgafb_template.h"
+#include "bcm2835_fb_template.h"
 #define BITS 32
-#include "milkymist-vgafb_template.h"
+#include "bcm2835_fb_template.h"
+
+/* Pixel order of 24 and 32 bpp modes, encoded as in the firmware */
+#define PIXEL_ORDER_BGR     0
+#define PIXEL_ORDER_RGB     1
+
+/* Mode changes waiting for the next refresh */
+#define FB_MODE_NONE        0
+#define FB_MODE_PAN         1
+#define FB_MODE_RESIZE      2
+
+/* Host surface depths */
+#define FB_DEST_COUNT       5
+
+/* Refresh back-off: after FB_IDLE_REFRESHES refreshes with nothing to
+ * draw, the number of refreshes skipped between two updates doubles, up
+ * to FB_SKIP_MAX.
+ */
+#define FB_IDLE_REFRESHES   8
+#define FB_SKIP_MAX         7
+
+static drawfn draw_line_table[FB_SRC_COUNT][FB_DEST_COUNT] = {
+    [FB_SRC_8] = { draw_line8_8, draw_line8_15, draw_line8_16,
+        draw_line8_24, draw_line8_32 },
+    [FB_SRC_16] = { draw_line16_8, draw_line16_15, draw_line16_16,
+        draw_line16_24, draw_line16_32 },
+    [FB_SRC_24] = { draw_line24_8, draw_line24_15, draw_line24_16,
+        draw_line24_24, draw_line24_32 },
+    [FB_SRC_24BGR] = { draw_line24bgr_8, draw_line24bgr_15,
+        draw_line24bgr_16, draw_line24bgr_24, draw_line24bgr_32 },
+    [FB_SRC_32] = { draw_line32_8, draw_line32_15, draw_line32_16,
+        draw_line32_24, draw_line32_32 },
+    [FB_SRC_32BGR] = { draw_line32bgr_8, draw_line32bgr_15,
+        draw_line32bgr_16, draw_line32bgr_24, draw_line32bgr_32 },
+};
 
 typedef struct {
     SysBusDevice busdev;
@@ -60,14 +97,157 @@ typedef struct {
     DisplayState *ds;
     int invalidate;
     int enabled;
+    int mode_change;        /* FB_MODE_*, applied by the next refresh */
     
     uint32_t xres, yres;
     uint32_t xres_virtual, yres_virtual;
     uint32_t xoffset, yoffset;
     uint32_t bpp;
     uint32_t base, pitch, size;
+    uint32_t scanout;       /* Bus address of the visible area */
+
+    uint32_t pixo;          /* PIXEL_ORDER_*, for 24 and 32 bpp */
+    int src;                /* FB_SRC_* */
+    uint32_t palette[256];  /* 8 bpp colours, 0x00RRGGBB */
+
+    uint32_t share;         /* Display the guest framebuffer in place */
+    MemoryRegion *mem;      /* RAM holding the framebuffer, or NULL */
+    hwaddr mem_offset;      /* Of the base, within mem */
+    uint8_t *shared;        /* Host view of the visible area, or NULL */
+
+    int idle;               /* Refreshes in a row with nothing to draw */
+    int skip;               /* Refreshes to skip between updates */
+    int countdown;          /* Refreshes left to skip */
+    int64_t last_ms;        /* rt_clock time of the last update */
+    uint32_t interval_ms;   /* Between the last two updates */
+    uint64_t skipped;       /* Refreshes skipped */
 } bcm2835_fb_state;
 
+/* Console surface on top of the visible area */
+static void fb_share_surface(bcm2835_fb_state *s)
+{
+    s->shared = (uint8_t *)memory_region_get_ram_ptr(s->mem)
+        + s->mem_offset + (s->scanout - s->base);
+    qemu_free_displaysurface(s->ds);
+    s->ds->surface = qemu_create_displaysurface_from(s->xres, s->yres,
+        s->bpp, s->pitch, s->shared);
+}
+
+/* When the console can show the guest pixel format as it is, point its
+ * surface straight at the framebuffer so that nothing gets copied.
+ * Otherwise give it a surface of its own for the line functions.
+ */
+static void fb_resize(bcm2835_fb_state *s)
+{
+    MemoryRegionSection section;
+
+    s->mem = NULL;
+    s->shared = NULL;
+    section = memory_region_find(sysbus_address_space(&s->busdev),
+        s->base, s->size);
+    if (section.mr && memory_region_is_ram(section.mr)
+        && section.size >= s->size) {
+        s->mem = section.mr;
+        s->mem_offset = section.offset_within_region;
+    }
+
+#ifndef HOST_WORDS_BIGENDIAN
+    if (s->mem && s->share
+        && (s->src == FB_SRC_32 || s->src == FB_SRC_16)) {
+        fb_share_surface(s);
+        dpy_gfx_resize(s->ds);
+        return;
+    }
+#endif
+    qemu_console_resize(s->ds, s->xres, s->yres);
+}
+
+/* Panning within the virtual resolution: same mode, other scanout */
+static void fb_pan(bcm2835_fb_state *s)
+{
+    if (s->shared) {
+        fb_share_surface(s);
+        dpy_gfx_setdata(s->ds);
+    }
+}
+
+/* Shared surface: the console reads guest memory itself, so all that is
+ * left to do is tell it which lines changed.
+ */
+static int fb_update_shared(bcm2835_fb_state *s)
+{
+    hwaddr start = s->mem_offset + (s->scanout - s->base);
+    hwaddr addr = start;
+    hwaddr line = s->xres * (s->bpp >> 3);
+    int first = -1;
+    int dirty = 0;
+    int y;
+
+    if (ds_get_data(s->ds) != s->shared) {
+        // Surface replaced behind our back
+        fb_resize(s);
+        s->invalidate = 1;
+    }
+
+    memory_region_sync_dirty_bitmap(s->mem);
+    for (y = 0; y < (int)s->yres; y++, addr += s->pitch) {
+        if (s->invalidate
+            || memory_region_get_dirty(s->mem, addr, line, DIRTY_MEMORY_VGA)) {
+            if (first < 0) {
+                first = y;
+            }
+            dirty = 1;
+        } else if (first >= 0) {
+            dpy_gfx_update(s->ds, 0, first, s->xres, y - first);
+            first = -1;
+        }
+    }
+    if (first >= 0) {
+        dpy_gfx_update(s->ds, 0, first, s->xres, s->yres - first);
+    }
+    memory_region_reset_dirty(s->mem, start,
+        (hwaddr)(s->yres - 1) * s->pitch + line, DIRTY_MEMORY_VGA);
+
+    s->invalidate = 0;
+    return dirty;
+}
+
+/* Whether this refresh can be skipped. While backed off, a skipped
+ * refresh does not look at the dirty bitmap at all: the update at the
+ * end of the countdown syncs and walks it once, and the first dirty
+ * line it finds brings the full rate back.
+ */
+static int fb_idle(bcm2835_fb_state *s)
+{
+    int64_t now;
+
+    if (s->countdown > 0 && !s->invalidate) {
+        s->countdown--;
+        s->skipped++;
+        return 1;
+    }
+
+    now = qemu_get_clock_ms(rt_clock);
+    if (s->last_ms) {
+        s->interval_ms = now - s->last_ms;
+    }
+    s->last_ms = now;
+    return 0;
+}
+
+/* Back off after a run of refreshes with nothing to draw */
+static void fb_pace(bcm2835_fb_state *s, int dirty)
+{
+    if (dirty) {
+        s->idle = 0;
+        s->skip = 0;
+    } else if (++s->idle >= FB_IDLE_REFRESHES) {
+        s->idle = 0;
+        s->skip = MIN(s->skip * 2 + 1, FB_SKIP_MAX);
+    }
+    s->countdown = s->skip;
+}
+
 static void fb_invalidate_display(void *opaque)
 {
     bcm2835_fb_state *s = (bcm2835_fb_state *)opaque;
@@ -79,58 +259,73 @@ static void fb_update_display(void *opaque)
     int first = 0;
     int last = 0;
     drawfn fn;
+    drawfn simd;
 
-    int src_width = 0;
     int dest_width = 0;
     
     if (!s->enabled)
         return;
-    
-    // Assuming source is 16bpp for now
-    src_width = s->xres * 2;
+    if (s->mode_change == FB_MODE_RESIZE) {
+        fb_resize(s);
+    } else if (s->mode_change == FB_MODE_PAN) {
+        fb_pan(s);
+    }
+    s->mode_change = FB_MODE_NONE;
+    if (fb_idle(s))
+        return;
+    if (s->shared) {
+        fb_pace(s, fb_update_shared(s));
+        return;
+    }
     
     dest_width = s->xres;
     switch (ds_get_bits_per_pixel(s->ds)) {
     case 0:
         return;
     case 8:
-        fn = draw_line_8;
+        fn = draw_line_table[s->src][0];
         break;
     case 15:
-        fn = draw_line_15;
+        fn = draw_line_table[s->src][1];
         dest_width *= 2;
         break;
     case 16:
-        fn = draw_line_16;
+        fn = draw_line_table[s->src][2];
         dest_width *= 2;
         break;
     case 24:
-        fn = draw_line_24;
+        fn = draw_line_table[s->src][3];
         dest_width *= 3;
         break;
     case 32:
-        fn = draw_line_32;
+        fn = draw_line_table[s->src][4];
         dest_width *= 4;
         break;
     default:
-        hw_error("milkymist_vgafb: bad color depth\n");
+        hw_error("bcm2835_fb: bad color depth\n");
         break;
     }
+    // Vector version of the same, if the host CPU has one
+    simd = bcm2835_fb_simd_line(s->src, ds_get_bits_per_pixel(s->ds));
+    if (simd) {
+        fn = simd;
+    }
 
     framebuffer_update_display(s->ds, sysbus_address_space(&s->busdev),
-        s->base,
+        s->scanout,
         s->xres,
         s->yres,
-        src_width,
+        s->pitch,
         dest_width,
         0,
         s->invalidate,
         fn,
-        NULL,
+        s->palette,
         &first, &last);
     if (first >= 0) {
         dpy_gfx_update(s->ds, 0, first, s->xres, last - first + 1);
     }
+    fb_pace(s, first >= 0);
 
     s->invalidate = 0;
 }
@@ -139,35 +334,110 @@ static void fb_update_display(void *opaque)
 
 static void bcm2835_fb_mbox_push(bcm2835_fb_state *s, uint32_t value) 
 {
+    uint32_t xres, yres, xres_virtual, yres_virtual, bpp;
+    uint32_t bytes;
+    uint16_t rgb565;
+    int pan;
+    int n;
+
     value &= ~0xf;
     
-    s->xres = ldl_phys(value);
-    s->yres = ldl_phys(value + 4);
-    s->xres_virtual = ldl_phys(value + 8);
-    s->yres_virtual = ldl_phys(value + 12);
+    xres = ldl_phys(value);
+    yres = ldl_phys(value + 4);
+    xres_virtual = ldl_phys(value + 8);
+    yres_virtual = ldl_phys(value + 12);
+    bpp = ldl_phys(value + 20);
+
+    // No virtual resolution, or a smaller one, means the visible one
+    if (xres_virtual < xres) {
+        xres_virtual = xres;
+    }
+    if (yres_virtual < yres) {
+        yres_virtual = yres;
+    }
+
+    // Same mode again, only the offsets may have changed
+    pan = s->enabled && xres == s->xres && yres == s->yres
+        && xres_virtual == s->xres_virtual && yres_virtual == s->yres_virtual
+        && bpp == s->bpp;
+
+    s->xres = xres;
+    s->yres = yres;
+    s->xres_virtual = xres_virtual;
+    s->yres_virtual = yres_virtual;
     
-    s->bpp = ldl_phys(value + 20);
+    s->bpp = bpp;
     s->xoffset = ldl_phys(value + 24);
     s->yoffset = ldl_phys(value + 28);
     
     s->base = bcm2835_vcram_base | (value & 0xc0000000);
 
-    assert(s->bpp == 16);
+    switch (s->bpp) {
+    case 8:
+        s->src = FB_SRC_8;
+        // RGB565 palette after the request
+        for (n = 0; n < 256; n++) {
+            rgb565 = lduw_phys(value + 40 + n * 2);
+            s->palette[n] = (((rgb565 >> 11) & 0x1f) << 19)
+                | (((rgb565 >> 5) & 0x3f) << 10)
+                | ((rgb565 & 0x1f) << 3);
+        }
+        break;
+    case 16:
+        s->src = FB_SRC_16;
+        break;
+    case 24:
+        s->src = s->pixo == PIXEL_ORDER_RGB ? FB_SRC_24 : FB_SRC_24BGR;
+        break;
+    case 32:
+        s->src = s->pixo == PIXEL_ORDER_RGB ? FB_SRC_32 : FB_SRC_32BGR;
+        break;
+    default:
+        qemu_log_mask(LOG_GUEST_ERROR,
+            "bcm2835_fb_mbox_push: Bad depth %d\n", s->bpp);
+        s->enabled = 0;
+        stl_phys(value + 32, 0);
+        return;
+    }
+    bytes = s->bpp >> 3;
+
+    if (s->xres == 0 || s->yres == 0
+        || (uint64_t)s->xres_virtual * s->yres_virtual * bytes > VCRAM_SIZE) {
+        qemu_log_mask(LOG_GUEST_ERROR,
+            "bcm2835_fb_mbox_push: Bad resolution %dx%d (virtual %dx%d)\n",
+            s->xres, s->yres, s->xres_virtual, s->yres_virtual);
+        s->enabled = 0;
+        stl_phys(value + 32, 0);
+        return;
+    }
+    s->pitch = s->xres_virtual * bytes;
+    s->size = s->yres_virtual * s->pitch;
 
-    // TODO - Manage properly virtual resolution
-    /*if (s->bpp == 16) {
-        s->pitch = ((s->xres_virtual + 1) & ~1) * 2;
+    if (s->xoffset > s->xres_virtual - s->xres
+        || s->yoffset > s->yres_virtual - s->yres) {
+        qemu_log_mask(LOG_GUEST_ERROR,
+            "bcm2835_fb_mbox_push: Bad offset %d,%d\n",
+            s->xoffset, s->yoffset);
+        s->xoffset = MIN(s->xoffset, s->xres_virtual - s->xres);
+        s->yoffset = MIN(s->yoffset, s->yres_virtual - s->yres);
     }
-    s->size = s->yres_virtual * s->pitch; 
-    */
-    s->pitch = s->xres * 2;
-    s->size = s->yres * s->pitch;
+    s->scanout = s->base + s->yoffset * s->pitch + s->xoffset * bytes;
     
+    stl_phys(value + 8, s->xres_virtual);
+    stl_phys(value + 12, s->yres_virtual);
     stl_phys(value + 16, s->pitch);
+    stl_phys(value + 24, s->xoffset);
+    stl_phys(value + 28, s->yoffset);
     stl_phys(value + 32, s->base);
     stl_phys(value + 36, s->size);
     
-    qemu_console_resize(s->ds, s->xres, s->yres);
+    // The surface belongs to whichever console is in front, so it is only
+    // replaced from the refresh, which runs for the graphic console alone
+    if (!pan) {
+        s->mode_change = FB_MODE_RESIZE;
+    } else if (s->mode_change == FB_MODE_NONE) {
+        s->mode_change = FB_MODE_PAN;
+    }
     s->enabled = 1;
     s->invalidate = 1;    
 }
@@ -230,6 +500,22 @@ static const VMStateDescription vmstate_bcm2835_fb = {
     }
 };
 
+static void bcm2835_fb_get_refresh_interval(Object *obj, Visitor *v,
+    void *opaque, const char *name, Error **errp)
+{
+    bcm2835_fb_state *s = (bcm2835_fb_state *)opaque;
+
+    visit_type_uint32(v, &s->interval_ms, name, errp);
+}
+
+static void bcm2835_fb_get_skipped(Object *obj, Visitor *v,
+    void *opaque, const char *name, Error **errp)
+{
+    bcm2835_fb_state *s = (bcm2835_fb_state *)opaque;
+
+    visit_type_uint64(v, &s->skipped, name, errp);
+}
+
 static int bcm2835_fb_init(SysBusDevice *dev)
 {
     bcm2835_fb_state *s = FROM_SYSBUS(bcm2835_fb_state, dev);
@@ -238,6 +524,18 @@ static int bcm2835_fb_init(SysBusDevice *dev)
     
     s->invalidate = 0;
     s->enabled = 0;
+    s->mode_change = FB_MODE_NONE;
+    s->src = FB_SRC_16;
+    memset(s->palette, 0, sizeof(s->palette));
+    s->mem = NULL;
+    s->shared = NULL;
+    s->idle = 0;
+    s->skip = 0;
+    s->countdown = 0;
+    s->last_ms = 0;
+    s->interval_ms = 0;
+    s->skipped = 0;
+    bcm2835_fb_simd_init();
         
     sysbus_init_irq(dev, &s->mbox_irq);
     
@@ -249,14 +547,28 @@ static int bcm2835_fb_init(SysBusDevice *dev)
     sysbus_init_mmio(dev, &s->iomem);
     vmstate_register(&dev->qdev, -1, &vmstate_bcm2835_fb, s);
 
+    object_property_add(OBJECT(dev), "refresh-interval-ms", "uint32",
+        bcm2835_fb_get_refresh_interval, NULL, NULL, s, NULL);
+    object_property_add(OBJECT(dev), "skipped-frames", "uint64",
+        bcm2835_fb_get_skipped, NULL, NULL, s, NULL);
+
     return 0;
 }
 
+static Property bcm2835_fb_properties[] = {
+    DEFINE_PROP_UINT32("pixel-order", bcm2835_fb_state, pixo,
+        PIXEL_ORDER_RGB),
+    DEFINE_PROP_UINT32("share-surface", bcm2835_fb_state, share, 1),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
 static void bcm2835_fb_class_init(ObjectClass *klass, void *data)
 {
+    DeviceClass *dc = DEVICE_CLASS(klass);
     SysBusDeviceClass *sdc = SYS_BUS_DEVICE_CLASS(klass);
 
     sdc->init = bcm2835_fb_init;
+    dc->props = bcm2835_fb_properties;
 }
 
 static TypeInfo bcm2835_fb_info = {
@@ -0,0 +1,311 @@
+/*
+ * Raspberry Pi emulation (c) 2012 Gregory Estrade
+ * This code is licensed under the GNU GPLv2 and later.
+ */
+
+/* Vector versions of the framebuffer line functions for the common
+ * cases: 16, 24 and 32 bpp guests on a 32 bpp host surface. They give
+ * the same pixels as bcm2835_fb_template.h, which bcm2835_fb_bench.c
+ * checks. On x86 the widest the host CPU can run is picked at run time,
+ * other hosts keep the template ones.
+ */
+
+#include "qemu-common.h"
+#include "framebuffer.h"
+#include "bcm2835_fb_simd.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__) \
+    && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define FB_SIMD_X86
+#include <immintrin.h>
+#endif
+
+/* Scalar ends of lines. r and b are the offsets of the red and blue
+ * bytes in a source pixel.
+ */
+static inline void fb_tail16(uint32_t *d, const uint8_t *s, int width)
+{
+    uint32_t p;
+
+    while (width--) {
+        p = lduw_le_p(s);
+        *d++ = ((p & 0xf800) << 8) | ((p & 0x07e0) << 5) | ((p & 0x001f) << 3);
+        s += 2;
+    }
+}
+
+static inline void fb_tail24(uint32_t *d, const uint8_t *s, int width,
+    int step, int r, int b)
+{
+    while (width--) {
+        *d++ = (s[r] << 16) | (s[1] << 8) | s[b];
+        s += step;
+    }
+}
+
+#ifndef HOST_WORDS_BIGENDIAN
+/* 16 bpp on a 16 bpp surface is the same RGB565, on little endian hosts */
+static void fb_line16_16(void *opaque, uint8_t *d, const uint8_t *s,
+    int width, int deststep)
+{
+    memcpy(d, s, width * 2);
+}
+#endif
+
+#ifdef FB_SIMD_X86
+
+static int fb_has_sse2;
+static int fb_has_ssse3;
+static int fb_has_avx2;
+
+/* RGB565 in the low half of each 32 bit lane to 0x00RRGGBB */
+#define FB_565_SSE2(x)                                                  \
+    _mm_or_si128(_mm_or_si128(                                          \
+        _mm_slli_epi32(_mm_and_si128(x, _mm_set1_epi32(0xf800)), 8),    \
+        _mm_slli_epi32(_mm_and_si128(x, _mm_set1_epi32(0x07e0)), 5)),   \
+        _mm_slli_epi32(_mm_and_si128(x, _mm_set1_epi32(0x001f)), 3))
+
+#define FB_565_AVX2(x)                                                      \
+    _mm256_or_si256(_mm256_or_si256(                                        \
+        _mm256_slli_epi32(_mm256_and_si256(x, _mm256_set1_epi32(0xf800)), 8), \
+        _mm256_slli_epi32(_mm256_and_si256(x, _mm256_set1_epi32(0x07e0)), 5)),\
+        _mm256_slli_epi32(_mm256_and_si256(x, _mm256_set1_epi32(0x001f)), 3))
+
+/* Swap the red and blue bytes of each 32 bit lane, dropping the top one */
+#define FB_SWAP_SSE2(x)                                                 \
+    _mm_or_si128(_mm_or_si128(                                          \
+        _mm_slli_epi32(_mm_and_si128(x, _mm_set1_epi32(0xff)), 16),     \
+        _mm_and_si128(x, _mm_set1_epi32(0xff00))),                      \
+        _mm_and_si128(_mm_srli_epi32(x, 16), _mm_set1_epi32(0xff)))
+
+#define FB_SWAP_AVX2(x)                                                     \
+    _mm256_or_si256(_mm256_or_si256(                                        \
+        _mm256_slli_epi32(_mm256_and_si256(x, _mm256_set1_epi32(0xff)), 16),\
+        _mm256_and_si256(x, _mm256_set1_epi32(0xff00))),                    \
+        _mm256_and_si256(_mm256_srli_epi32(x, 16), _mm256_set1_epi32(0xff)))
+
+__attribute__((target("sse2")))
+static void fb_line16_32_sse2(void *opaque, uint8_t *d, const uint8_t *s,
+    int width, int deststep)
+{
+    const __m128i zero = _mm_setzero_si128();
+    uint32_t *out = (uint32_t *)d;
+    __m128i p;
+
+    for (; width >= 8; width -= 8) {
+        p = _mm_loadu_si128((const __m128i *)s);
+        _mm_storeu_si128((__m128i *)out,
+            FB_565_SSE2(_mm_unpacklo_epi16(p, zero)));
+        _mm_storeu_si128((__m128i *)(out + 4),
+            FB_565_SSE2(_mm_unpackhi_epi16(p, zero)));
+        s += 16;
+        out += 8;
+    }
+    fb_tail16(out, s, width);
+}
+
+__attribute__((target("avx2")))
+static void fb_line16_32_avx2(void *opaque, uint8_t *d, const uint8_t *s,
+    int width, int deststep)
+{
+    uint32_t *out = (uint32_t *)d;
+    __m256i lo, hi;
+
+    for (; width >= 16; width -= 16) {
+        lo = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)s));
+        hi = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)(s + 16)));
+        _mm256_storeu_si256((__m256i *)out, FB_565_AVX2(lo));
+        _mm256_storeu_si256((__m256i *)(out + 8), FB_565_AVX2(hi));
+        s += 32;
+        out += 16;
+    }
+    fb_tail16(out, s, width);
+}
+
+__attribute__((target("sse2")))
+static void fb_line32_32_sse2(void *opaque, uint8_t *d, const uint8_t *s,
+    int width, int deststep)
+{
+    const __m128i mask = _mm_set1_epi32(0x00ffffff);
+    uint32_t *out = (uint32_t *)d;
+
+    for (; width >= 4; width -= 4) {
+        _mm_storeu_si128((__m128i *)out, _mm_and_si128(mask,
+            _mm_loadu_si128((const __m128i *)s)));
+        s += 16;
+        out += 4;
+    }
+    fb_tail24(out, s, width, 4, 2, 0);
+}
+
+__attribute__((target("avx2")))
+static void fb_line32_32_avx2(void *opaque, uint8_t *d, const uint8_t *s,
+    int width, int deststep)
+{
+    const __m256i mask = _mm256_set1_epi32(0x00ffffff);
+    uint32_t *out = (uint32_t *)d;
+
+    for (; width >= 8; width -= 8) {
+        _mm256_storeu_si256((__m256i *)out, _mm256_and_si256(mask,
+            _mm256_loadu_si256((const __m256i *)s)));
+        s += 32;
+        out += 8;
+    }
+    fb_tail24(out, s, width, 4, 2, 0);
+}
+
+__attribute__((target("sse2")))
+static void fb_line32bgr_32_sse2(void *opaque, uint8_t *d,
+    const uint8_t *s, int width, int deststep)
+{
+    uint32_t *out = (uint32_t *)d;
+    __m128i p;
+
+    for (; width >= 4; width -= 4) {
+        p = _mm_loadu_si128((const __m128i *)s);
+        _mm_storeu_si128((__m128i *)out, FB_SWAP_SSE2(p));
+        s += 16;
+        out += 4;
+    }
+    fb_tail24(out, s, width, 4, 0, 2);
+}
+
+__attribute__((target("avx2")))
+static void fb_line32bgr_32_avx2(void *opaque, uint8_t *d,
+    const uint8_t *s, int width, int deststep)
+{
+    uint32_t *out = (uint32_t *)d;
+    __m256i p;
+
+    for (; width >= 8; width -= 8) {
+        p = _mm256_loadu_si256((const __m256i *)s);
+        _mm256_storeu_si256((__m256i *)out, FB_SWAP_AVX2(p));
+        s += 32;
+        out += 8;
+    }
+    fb_tail24(out, s, width, 4, 0, 2);
+}
+
+/* 24 bpp takes a byte shuffle. Each 16 byte load holds 4 pixels and 4
+ * spare bytes, so it only runs while they are still within the line.
+ */
+#define FB_SHUF24(r, b)                                                 \
+    _mm_setr_epi8(b, 1, r, -1, b + 3, 4, r + 3, -1,                     \
+        b + 6, 7, r + 6, -1, b + 9, 10, r + 9, -1)
+
+__attribute__((target("ssse3")))
+static inline void fb_line24_32_ssse3(uint32_t *out, const uint8_t *s,
+    int width, __m128i shuf, int r, int b)
+{
+    for (; width >= 6; width -= 4) {
+        _mm_storeu_si128((__m128i *)out, _mm_shuffle_epi8(
+            _mm_loadu_si128((const __m128i *)s), shuf));
+        s += 12;
+        out += 4;
+    }
+    fb_tail24(out, s, width, 3, r, b);
+}
+
+__attribute__((target("ssse3")))
+static void fb_line24rgb_32_ssse3(void *opaque, uint8_t *d,
+    const uint8_t *s, int width, int deststep)
+{
+    fb_line24_32_ssse3((uint32_t *)d, s, width, FB_SHUF24(2, 0), 2, 0);
+}
+
+__attribute__((target("ssse3")))
+static void fb_line24bgr_32_ssse3(void *opaque, uint8_t *d,
+    const uint8_t *s, int width, int deststep)
+{
+    fb_line24_32_ssse3((uint32_t *)d, s, width, FB_SHUF24(0, 2), 0, 2);
+}
+
+/* Two lanes of 4 pixels, 12 bytes apart */
+__attribute__((target("avx2")))
+static inline void fb_line24_32_avx2(uint32_t *out, const uint8_t *s,
+    int width, __m128i shuf, int r, int b)
+{
+    const __m256i shuf2 = _mm256_broadcastsi128_si256(shuf);
+    __m256i p;
+
+    for (; width >= 10; width -= 8) {
+        p = _mm256_inserti128_si256(_mm256_castsi128_si256(
+            _mm_loadu_si128((const __m128i *)s)),
+            _mm_loadu_si128((const __m128i *)(s + 12)), 1);
+        _mm256_storeu_si256((__m256i *)out, _mm256_shuffle_epi8(p, shuf2));
+        s += 24;
+        out += 8;
+    }
+    fb_tail24(out, s, width, 3, r, b);
+}
+
+__attribute__((target("avx2")))
+static void fb_line24rgb_32_avx2(void *opaque, uint8_t *d,
+    const uint8_t *s, int width, int deststep)
+{
+    fb_line24_32_avx2((uint32_t *)d, s, width, FB_SHUF24(2, 0), 2, 0);
+}
+
+__attribute__((target("avx2")))
+static void fb_line24bgr_32_avx2(void *opaque, uint8_t *d,
+    const uint8_t *s, int width, int deststep)
+{
+    fb_line24_32_avx2((uint32_t *)d, s, width, FB_SHUF24(0, 2), 0, 2);
+}
+
+void bcm2835_fb_simd_init(void)
+{
+    __builtin_cpu_init();
+    fb_has_sse2 = __builtin_cpu_supports("sse2");
+    fb_has_ssse3 = __builtin_cpu_supports("ssse3");
+    fb_has_avx2 = __builtin_cpu_supports("avx2");
+}
+
+static drawfn fb_simd_line32(int src)
+{
+    if (!fb_has_sse2) {
+        // i386 hosts may not even have that
+        return NULL;
+    }
+    switch (src) {
+    case FB_SRC_16:
+        return fb_has_avx2 ? fb_line16_32_avx2 : fb_line16_32_sse2;
+    case FB_SRC_24:
+        return fb_has_avx2 ? fb_line24rgb_32_avx2
+            : fb_has_ssse3 ? fb_line24rgb_32_ssse3 : NULL;
+    case FB_SRC_24BGR:
+        return fb_has_avx2 ? fb_line24bgr_32_avx2
+            : fb_has_ssse3 ? fb_line24bgr_32_ssse3 : NULL;
+    case FB_SRC_32:
+        return fb_has_avx2 ? fb_line32_32_avx2 : fb_line32_32_sse2;
+    case FB_SRC_32BGR:
+        return fb_has_avx2 ? fb_line32bgr_32_avx2 : fb_line32bgr_32_sse2;
+    }
+    return NULL;
+}
+
+#else
+
+void bcm2835_fb_simd_init(void)
+{
+}
+
+static drawfn fb_simd_line32(int src)
+{
+    return NULL;
+}
+
+#endif
+
+drawfn bcm2835_fb_simd_line(int src, int dest_bits)
+{
+#ifndef HOST_WORDS_BIGENDIAN
+    if (dest_bits == 16 && src == FB_SRC_16) {
+        return fb_line16_16;
+    }
+#endif
+    if (dest_bits == 32) {
+        return fb_simd_line32(src);
+    }
+    return NULL;
+}
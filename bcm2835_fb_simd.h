@@ -0,0 +1,32 @@
+/*
+ * Raspberry Pi emulation (c) 2012 Gregory Estrade
+ * This code is licensed under the GNU GPLv2 and later.
+ */
+
+#ifndef __BCM2835_FB_SIMD_H
+#define __BCM2835_FB_SIMD_H
+
+#include "framebuffer.h"
+
+/* Guest pixel formats */
+enum {
+    FB_SRC_8,
+    FB_SRC_16,
+    FB_SRC_24,
+    FB_SRC_24BGR,
+    FB_SRC_32,
+    FB_SRC_32BGR,
+    FB_SRC_COUNT
+};
+
+/* Look up what the host CPU supports. Called once before any
+ * bcm2835_fb_simd_line().
+ */
+void bcm2835_fb_simd_init(void);
+
+/* Vector line function converting the src format for a host surface of
+ * dest_bits bits per pixel, or NULL if the template one has to do.
+ */
+drawfn bcm2835_fb_simd_line(int src, int dest_bits);
+
+#endif
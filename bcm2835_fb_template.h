@@ -0,0 +1,141 @@
+/*
+ * Raspberry Pi emulation (c) 2012 Gregory Estrade
+ * This code is licensed under the GNU GPLv2 and later.
+ */
+
+// Based on milkymist-vgafb_template.h, copyright terms below.
+
+/*
+ *  QEMU model of the Milkymist VGA framebuffer.
+ *
+ *  Copyright (c) 2010 Michael Walle <michael@walle.cc>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* One line function per guest pixel format, for a host surface of BITS
+ * bits per pixel. Included once for each host depth.
+ */
+
+#if BITS == 8
+#define COPY_PIXEL(to, r, g, b)                    \
+    do {                                           \
+        *to = rgb_to_pixel8(r, g, b);              \
+        to += 1;                                   \
+    } while (0)
+#elif BITS == 15
+#define COPY_PIXEL(to, r, g, b)                    \
+    do {                                           \
+        *(uint16_t *)to = rgb_to_pixel15(r, g, b); \
+        to += 2;                                   \
+    } while (0)
+#elif BITS == 16
+#define COPY_PIXEL(to, r, g, b)                    \
+    do {                                           \
+        *(uint16_t *)to = rgb_to_pixel16(r, g, b); \
+        to += 2;                                   \
+    } while (0)
+#elif BITS == 24
+#define COPY_PIXEL(to, r, g, b)                    \
+    do {                                           \
+        uint32_t tmp = rgb_to_pixel24(r, g, b);    \
+        *(to++) = tmp & 0xff;                      \
+        *(to++) = (tmp >> 8) & 0xff;               \
+        *(to++) = (tmp >> 16) & 0xff;              \
+    } while (0)
+#elif BITS == 32
+#define COPY_PIXEL(to, r, g, b)                    \
+    do {                                           \
+        *(uint32_t *)to = rgb_to_pixel32(r, g, b); \
+        to += 4;                                   \
+    } while (0)
+#else
+#error unknown bit depth
+#endif
+
+/* 8 bpp, through the palette the guest passed along with the mailbox
+ * request, as 0x00RRGGBB.
+ */
+static void glue(draw_line8_, BITS)(void *opaque, uint8_t *d,
+    const uint8_t *s, int width, int deststep)
+{
+    const uint32_t *palette = (const uint32_t *)opaque;
+    uint32_t rgb;
+
+    while (width--) {
+        rgb = palette[*s];
+        COPY_PIXEL(d, (rgb >> 16) & 0xff, (rgb >> 8) & 0xff, rgb & 0xff);
+        s += 1;
+    }
+}
+
+/* 16 bpp, RGB565 */
+static void glue(draw_line16_, BITS)(void *opaque, uint8_t *d,
+    const uint8_t *s, int width, int deststep)
+{
+    uint16_t rgb565;
+    uint8_t r, g, b;
+
+    while (width--) {
+        rgb565 = lduw_le_p(s);
+        r = ((rgb565 >> 11) & 0x1f) << 3;
+        g = ((rgb565 >>  5) & 0x3f) << 2;
+        b = ((rgb565 >>  0) & 0x1f) << 3;
+        COPY_PIXEL(d, r, g, b);
+        s += 2;
+    }
+}
+
+/* 24 bpp, 0xRRGGBB */
+static void glue(draw_line24_, BITS)(void *opaque, uint8_t *d,
+    const uint8_t *s, int width, int deststep)
+{
+    while (width--) {
+        COPY_PIXEL(d, s[2], s[1], s[0]);
+        s += 3;
+    }
+}
+
+/* 24 bpp, 0xBBGGRR */
+static void glue(draw_line24bgr_, BITS)(void *opaque, uint8_t *d,
+    const uint8_t *s, int width, int deststep)
+{
+    while (width--) {
+        COPY_PIXEL(d, s[0], s[1], s[2]);
+        s += 3;
+    }
+}
+
+/* 32 bpp, 0xXXRRGGBB */
+static void glue(draw_line32_, BITS)(void *opaque, uint8_t *d,
+    const uint8_t *s, int width, int deststep)
+{
+    while (width--) {
+        COPY_PIXEL(d, s[2], s[1], s[0]);
+        s += 4;
+    }
+}
+
+/* 32 bpp, 0xXXBBGGRR */
+static void glue(draw_line32bgr_, BITS)(void *opaque, uint8_t *d,
+    const uint8_t *s, int width, int deststep)
+{
+    while (width--) {
+        COPY_PIXEL(d, s[0], s[1], s[2]);
+        s += 4;
+    }
+}
+
+#undef BITS
+#undef COPY_PIXEL
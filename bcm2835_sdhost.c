@@ -0,0 +1,451 @@
+/*
+ * Raspberry Pi emulation (c) 2012 Gregory Estrade
+ * This code is licensed under the GNU GPLv2 and later.
+ */
+
+/* SDHOST, the Broadcom SD controller at MMCI0_BASE. It runs in parallel
+ * with the Arasan eMMC controller, on a card of its own.
+ */
+
+#include "sysbus.h"
+#include "qemu-common.h"
+#include "qdev.h"
+#include "sysemu/blockdev.h"
+#include "sd.h"
+
+#define SDCMD       0x00    /* Command to SD card */
+#define SDARG       0x04    /* Argument to SD card */
+#define SDTOUT      0x08    /* Start value for timeout counter */
+#define SDCDIV      0x0c    /* Start value for clock divider */
+#define SDRSP0      0x10    /* SD card response (31:0) */
+#define SDRSP1      0x14    /* SD card response (63:32) */
+#define SDRSP2      0x18    /* SD card response (95:64) */
+#define SDRSP3      0x1c    /* SD card response (127:96) */
+#define SDHSTS      0x20    /* SD host status */
+#define SDVDD       0x30    /* SD card power control */
+#define SDEDM       0x34    /* Emergency Debug Mode */
+#define SDHCFG      0x38    /* Host configuration */
+#define SDHBCT      0x3c    /* Host byte count (debug) */
+#define SDDATA      0x40    /* Data to/from SD card */
+#define SDHBLC      0x50    /* Host block count (SDIO/SDHC) */
+
+#define SDCMD_NEW_FLAG          0x8000
+#define SDCMD_FAIL_FLAG         0x4000
+#define SDCMD_BUSYWAIT          0x0800
+#define SDCMD_NO_RESPONSE       0x0400
+#define SDCMD_LONG_RESPONSE     0x0200
+#define SDCMD_WRITE_CMD         0x0080
+#define SDCMD_READ_CMD          0x0040
+#define SDCMD_CMD_MASK          0x003f
+
+#define SDCDIV_MAX_CDIV         0x07ff
+
+#define SDHSTS_BUSY_IRPT        0x0400
+#define SDHSTS_BLOCK_IRPT       0x0200
+#define SDHSTS_SDIO_IRPT        0x0100
+#define SDHSTS_REW_TIME_OUT     0x0080
+#define SDHSTS_CMD_TIME_OUT     0x0040
+#define SDHSTS_CRC16_ERROR      0x0020
+#define SDHSTS_CRC7_ERROR       0x0010
+#define SDHSTS_FIFO_ERROR       0x0008
+#define SDHSTS_DATA_FLAG        0x0001
+#define SDHSTS_CLEAR_MASK       0x07f8  /* write 1 to clear */
+
+#define SDVDD_POWER_ON          0x0001
+
+#define SDEDM_FSM_MASK          0x000f
+#define  SDEDM_FSM_IDENTMODE    0x0
+#define  SDEDM_FSM_DATAMODE     0x1
+#define  SDEDM_FSM_READDATA     0x2
+#define  SDEDM_FSM_WRITEDATA    0x3
+#define SDEDM_FIFO_FILL_SHIFT   4
+#define SDEDM_FIFO_FILL_MASK    0x1f
+#define SDEDM_FORCE_DATA_MODE   (1 << 19)
+#define SDEDM_WRITE_MASK        0x0007fe00  /* FIFO thresholds */
+
+#define SDHCFG_BUSY_IRPT_EN     (1 << 10)
+#define SDHCFG_BLOCK_IRPT_EN    (1 << 8)
+#define SDHCFG_SDIO_IRPT_EN     (1 << 5)
+#define SDHCFG_DATA_IRPT_EN     (1 << 4)
+
+#define SDDATA_FIFO_WORDS       16
+
+typedef struct {
+    SysBusDevice busdev;
+    MemoryRegion iomem;
+
+    SDState *card;
+    uint32_t drive_index;
+
+    uint32_t cmd;
+    uint32_t arg;
+    uint32_t tout;
+    uint32_t cdiv;
+    uint32_t rsp[4];
+    uint32_t hsts;
+    uint32_t vdd;
+    uint32_t edm;
+    uint32_t hcfg;
+    uint32_t hbct;
+    uint32_t hblc;
+
+    /* Data phase of the last command */
+    uint32_t data_left;     /* bytes still to move */
+    uint32_t block_pos;     /* bytes through the current block */
+
+    qemu_irq irq;
+    qemu_irq dreq;
+} bcm2835_sdhost_state;
+
+/* There is no data interrupt status as such: DATA_FLAG follows the
+ * FIFO, which has data for a read or room for a write as long as the
+ * data phase lasts.
+ */
+static int bcm2835_sdhost_data_flag(bcm2835_sdhost_state *s)
+{
+    if (s->data_left == 0) {
+        return 0;
+    }
+    if (s->cmd & SDCMD_READ_CMD) {
+        return sd_data_ready(s->card);
+    }
+    return 1;
+}
+
+static void bcm2835_sdhost_update(bcm2835_sdhost_state *s)
+{
+    int data = bcm2835_sdhost_data_flag(s);
+    int level = 0;
+
+    if ((s->hsts & SDHSTS_BUSY_IRPT) && (s->hcfg & SDHCFG_BUSY_IRPT_EN)) {
+        level = 1;
+    }
+    if ((s->hsts & SDHSTS_BLOCK_IRPT) && (s->hcfg & SDHCFG_BLOCK_IRPT_EN)) {
+        level = 1;
+    }
+    if ((s->hsts & SDHSTS_SDIO_IRPT) && (s->hcfg & SDHCFG_SDIO_IRPT_EN)) {
+        level = 1;
+    }
+    if (data && (s->hcfg & SDHCFG_DATA_IRPT_EN)) {
+        level = 1;
+    }
+    qemu_set_irq(s->irq, level);
+    qemu_set_irq(s->dreq, data);
+}
+
+/* The card state machine as the guest sees it in SDEDM */
+static void bcm2835_sdhost_set_fsm(bcm2835_sdhost_state *s, uint32_t fsm)
+{
+    s->edm = (s->edm & ~SDEDM_FSM_MASK) | fsm;
+}
+
+static void bcm2835_sdhost_command(bcm2835_sdhost_state *s)
+{
+    SDRequest request;
+    uint8_t response[16];
+    int resplen;
+
+    request.cmd = s->cmd & SDCMD_CMD_MASK;
+    request.arg = s->arg;
+    request.crc = 0;
+    resplen = sd_do_command(s->card, &request, response);
+
+    s->data_left = 0;
+    s->block_pos = 0;
+    if (s->cmd & SDCMD_NO_RESPONSE) {
+        // Nothing to check
+    } else if (resplen == 0) {
+        s->cmd |= SDCMD_FAIL_FLAG;
+        s->hsts |= SDHSTS_CMD_TIME_OUT;
+        return;
+    } else if (s->cmd & SDCMD_LONG_RESPONSE) {
+        if (resplen != 16) {
+            s->cmd |= SDCMD_FAIL_FLAG;
+            s->hsts |= SDHSTS_CMD_TIME_OUT;
+            return;
+        }
+        // Most significant word last, CRC byte included
+        s->rsp[3] = (response[0] << 24) | (response[1] << 16)
+            | (response[2] << 8) | response[3];
+        s->rsp[2] = (response[4] << 24) | (response[5] << 16)
+            | (response[6] << 8) | response[7];
+        s->rsp[1] = (response[8] << 24) | (response[9] << 16)
+            | (response[10] << 8) | response[11];
+        s->rsp[0] = (response[12] << 24) | (response[13] << 16)
+            | (response[14] << 8) | response[15];
+    } else {
+        s->rsp[0] = (response[0] << 24) | (response[1] << 16)
+            | (response[2] << 8) | response[3];
+        s->rsp[1] = 0;
+        s->rsp[2] = 0;
+        s->rsp[3] = 0;
+    }
+
+    if (s->cmd & (SDCMD_READ_CMD | SDCMD_WRITE_CMD)) {
+        s->data_left = s->hbct * s->hblc;
+        bcm2835_sdhost_set_fsm(s, (s->cmd & SDCMD_READ_CMD)
+            ? SDEDM_FSM_READDATA : SDEDM_FSM_WRITEDATA);
+    }
+    if (s->cmd & SDCMD_BUSYWAIT) {
+        // The card model is never busy for long
+        s->hsts |= SDHSTS_BUSY_IRPT;
+    }
+}
+
+/* Account for a word moved through SDDATA */
+static void bcm2835_sdhost_data_advance(bcm2835_sdhost_state *s)
+{
+    s->data_left -= 4;
+    s->block_pos += 4;
+    if (s->block_pos >= s->hbct) {
+        s->block_pos = 0;
+        if ((s->cmd & SDCMD_WRITE_CMD) && (s->hcfg & SDHCFG_BLOCK_IRPT_EN)) {
+            // Each block written to the card, if the guest asked
+            s->hsts |= SDHSTS_BLOCK_IRPT;
+        }
+    }
+    if (s->data_left == 0) {
+        bcm2835_sdhost_set_fsm(s, SDEDM_FSM_DATAMODE);
+    }
+}
+
+static uint32_t bcm2835_sdhost_data_read(bcm2835_sdhost_state *s)
+{
+    uint32_t value = 0;
+    int n;
+
+    if (s->data_left < 4 || !(s->cmd & SDCMD_READ_CMD)) {
+        s->hsts |= SDHSTS_FIFO_ERROR;
+        return 0;
+    }
+    for (n = 0; n < 4; n++) {
+        if (!sd_data_ready(s->card)) {
+            s->hsts |= SDHSTS_FIFO_ERROR;
+            break;
+        }
+        value |= sd_read_data(s->card) << (8 * n);
+    }
+    bcm2835_sdhost_data_advance(s);
+    return value;
+}
+
+static void bcm2835_sdhost_data_write(bcm2835_sdhost_state *s,
+    uint32_t value)
+{
+    int n;
+
+    if (s->data_left < 4 || !(s->cmd & SDCMD_WRITE_CMD)) {
+        s->hsts |= SDHSTS_FIFO_ERROR;
+        return;
+    }
+    for (n = 0; n < 4; n++) {
+        sd_write_data(s->card, value >> (8 * n));
+    }
+    bcm2835_sdhost_data_advance(s);
+}
+
+/* The FIFO fill level, in words, that the guest reads from SDEDM. An
+ * empty FIFO on writes leaves the whole FIFO as room.
+ */
+static uint32_t bcm2835_sdhost_fifo_fill(bcm2835_sdhost_state *s)
+{
+    if (!(s->cmd & SDCMD_READ_CMD) || !bcm2835_sdhost_data_flag(s)) {
+        return 0;
+    }
+    return MIN(s->data_left / 4, SDDATA_FIFO_WORDS);
+}
+
+static uint64_t bcm2835_sdhost_read(void *opaque, hwaddr offset,
+    unsigned size)
+{
+    bcm2835_sdhost_state *s = (bcm2835_sdhost_state *)opaque;
+    uint32_t res = 0;
+
+    switch(offset) {
+    case SDCMD:
+        res = s->cmd;
+        break;
+    case SDARG:
+        res = s->arg;
+        break;
+    case SDTOUT:
+        res = s->tout;
+        break;
+    case SDCDIV:
+        res = s->cdiv;
+        break;
+    case SDRSP0:
+    case SDRSP1:
+    case SDRSP2:
+    case SDRSP3:
+        res = s->rsp[(offset - SDRSP0) >> 2];
+        break;
+    case SDHSTS:
+        res = s->hsts;
+        if (bcm2835_sdhost_data_flag(s)) {
+            res |= SDHSTS_DATA_FLAG;
+        }
+        break;
+    case SDVDD:
+        res = s->vdd;
+        break;
+    case SDEDM:
+        res = s->edm | (bcm2835_sdhost_fifo_fill(s)
+            << SDEDM_FIFO_FILL_SHIFT);
+        break;
+    case SDHCFG:
+        res = s->hcfg;
+        break;
+    case SDHBCT:
+        res = s->hbct;
+        break;
+    case SDDATA:
+        res = bcm2835_sdhost_data_read(s);
+        break;
+    case SDHBLC:
+        res = s->hblc;
+        break;
+    default:
+        qemu_log_mask(LOG_GUEST_ERROR,
+            "bcm2835_sdhost_read: Bad offset %x\n", (int)offset);
+        return 0;
+    }
+
+    bcm2835_sdhost_update(s);
+    return res;
+}
+
+static void bcm2835_sdhost_write(void *opaque, hwaddr offset,
+    uint64_t value, unsigned size)
+{
+    bcm2835_sdhost_state *s = (bcm2835_sdhost_state *)opaque;
+
+    switch(offset) {
+    case SDCMD:
+        s->cmd = value & ~SDCMD_FAIL_FLAG;
+        if (s->cmd & SDCMD_NEW_FLAG) {
+            // Commands complete before the guest gets to poll for it
+            bcm2835_sdhost_command(s);
+            s->cmd &= ~SDCMD_NEW_FLAG;
+        }
+        break;
+    case SDARG:
+        s->arg = value;
+        break;
+    case SDTOUT:
+        s->tout = value;
+        break;
+    case SDCDIV:
+        s->cdiv = value & SDCDIV_MAX_CDIV;
+        break;
+    case SDHSTS:
+        s->hsts &= ~(value & SDHSTS_CLEAR_MASK);
+        break;
+    case SDVDD:
+        s->vdd = value & SDVDD_POWER_ON;
+        break;
+    case SDEDM:
+        s->edm = (s->edm & ~SDEDM_WRITE_MASK) | (value & SDEDM_WRITE_MASK);
+        if (value & SDEDM_FORCE_DATA_MODE) {
+            s->data_left = 0;
+            bcm2835_sdhost_set_fsm(s, SDEDM_FSM_DATAMODE);
+        }
+        break;
+    case SDHCFG:
+        s->hcfg = value;
+        break;
+    case SDHBCT:
+        s->hbct = value;
+        break;
+    case SDDATA:
+        bcm2835_sdhost_data_write(s, value);
+        break;
+    case SDHBLC:
+        s->hblc = value;
+        break;
+    default:
+        qemu_log_mask(LOG_GUEST_ERROR,
+            "bcm2835_sdhost_write: Bad offset %x\n", (int)offset);
+        return;
+    }
+
+    bcm2835_sdhost_update(s);
+}
+
+static const MemoryRegionOps bcm2835_sdhost_ops = {
+    .read = bcm2835_sdhost_read,
+    .write = bcm2835_sdhost_write,
+    .endianness = DEVICE_NATIVE_ENDIAN,
+};
+
+static const VMStateDescription vmstate_bcm2835_sdhost = {
+    .name = "bcm2835_sdhost",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .minimum_version_id_old = 1,
+    .fields      = (VMStateField[]) {
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static int bcm2835_sdhost_init(SysBusDevice *dev)
+{
+    bcm2835_sdhost_state *s = FROM_SYSBUS(bcm2835_sdhost_state, dev);
+    DriveInfo *di;
+
+    // Without a drive, the card never answers and the guest sees none
+    di = drive_get(IF_SD, 0, s->drive_index);
+    s->card = sd_init(di ? di->bdrv : NULL, 0);
+
+    s->cmd = 0;
+    s->arg = 0;
+    s->tout = 0;
+    s->cdiv = SDCDIV_MAX_CDIV;
+    memset(s->rsp, 0, sizeof(s->rsp));
+    s->hsts = 0;
+    s->vdd = 0;
+    s->edm = SDEDM_FSM_IDENTMODE;
+    s->hcfg = 0;
+    s->hbct = 0;
+    s->hblc = 0;
+    s->data_left = 0;
+    s->block_pos = 0;
+
+    memory_region_init_io(&s->iomem, &bcm2835_sdhost_ops, s,
+        "bcm2835_sdhost", 0x100);
+    sysbus_init_mmio(dev, &s->iomem);
+    vmstate_register(&dev->qdev, -1, &vmstate_bcm2835_sdhost, s);
+
+    sysbus_init_irq(dev, &s->irq);
+    sysbus_init_irq(dev, &s->dreq);
+
+    return 0;
+}
+
+static Property bcm2835_sdhost_properties[] = {
+    DEFINE_PROP_UINT32("drive-index", bcm2835_sdhost_state, drive_index, 1),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
+static void bcm2835_sdhost_class_init(ObjectClass *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+    SysBusDeviceClass *sdc = SYS_BUS_DEVICE_CLASS(klass);
+
+    sdc->init = bcm2835_sdhost_init;
+    dc->props = bcm2835_sdhost_properties;
+}
+
+static TypeInfo bcm2835_sdhost_info = {
+    .name          = "bcm2835_sdhost",
+    .parent        = TYPE_SYS_BUS_DEVICE,
+    .instance_size = sizeof(bcm2835_sdhost_state),
+    .class_init    = bcm2835_sdhost_class_init,
+};
+
+static void bcm2835_sdhost_register_types(void)
+{
+    type_register_static(&bcm2835_sdhost_info);
+}
+
+type_init(bcm2835_sdhost_register_types)
@@ -0,0 +1,42 @@
+#ifndef __BCM2835_STATS_H
+#define __BCM2835_STATS_H
+
+#include "qemu/host-utils.h"
+#include "qapi/visitor.h"
+
+/* Statistics helpers shared by the bcm2835 devices. Counters are
+ * published as read-only QOM properties, so they can be queried with
+ * the qom-get QMP command.
+ */
+
+#define HIST_BUCKETS 32
+
+/* log2 histogram: bucket n counts values in [2^n, 2^(n+1)), the first
+ * bucket also gets zeroes and the last one everything above.
+ */
+typedef struct {
+    uint64_t bucket[HIST_BUCKETS];
+} bcm2835_hist;
+
+static inline void bcm2835_hist_add(bcm2835_hist *h, uint64_t value)
+{
+    int n = value ? 63 - clz64(value) : 0;
+
+    h->bucket[MIN(n, HIST_BUCKETS - 1)]++;
+}
+
+static inline void bcm2835_visit_hist(Visitor *v, bcm2835_hist *h,
+    const char *name, Error **errp)
+{
+    char key[16];
+    int n;
+
+    visit_start_struct(v, NULL, NULL, name, 0, errp);
+    for (n = 0; n < HIST_BUCKETS; n++) {
+        snprintf(key, sizeof(key), "log2-%d", n);
+        visit_type_uint64(v, &h->bucket[n], key, errp);
+    }
+    visit_end_struct(v, errp);
+}
+
+#endif
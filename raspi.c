@@ -49,6 +49,7 @@ static void raspi_init(QEMUMachineInitArgs *args)
     MemoryRegion *per_prop_bus = g_new(MemoryRegion, 1);
     MemoryRegion *per_vchiq_bus = g_new(MemoryRegion, 1);
     MemoryRegion *per_emmc_bus = g_new(MemoryRegion, 1);
+    MemoryRegion *per_sdhost_bus = g_new(MemoryRegion, 1);
     MemoryRegion *per_dma1_bus = g_new(MemoryRegion, 1);
     MemoryRegion *per_dma2_bus = g_new(MemoryRegion, 1);
     
@@ -59,6 +60,8 @@ static void raspi_init(QEMUMachineInitArgs *args)
     qemu_irq mbox_irq[MBOX_CHAN_COUNT];
 
     DeviceState *dev;
+    DeviceState *emmc;
+    DeviceState *sdhost;
         SysBusDevice *s;
         
     int n;
@@ -207,6 +210,7 @@ static void raspi_init(QEMUMachineInitArgs *args)
     // Extended Mass Media Controller
     dev = sysbus_create_simple("bcm2835_emmc", EMMC_BASE, 
         pic[INTERRUPT_VC_ARASANSDIO]);
+    emmc = dev;
     s = sysbus_from_qdev(dev);
     mr = sysbus_mmio_get_region(s, 0);
     memory_region_init_alias(per_emmc_bus, NULL, mr, 
@@ -214,6 +218,17 @@ static void raspi_init(QEMUMachineInitArgs *args)
     memory_region_add_subregion(sysmem, BUS_ADDR(EMMC_BASE), 
         per_emmc_bus);
 
+    // SD host controller, serving the second SD drive
+    dev = sysbus_create_simple("bcm2835_sdhost", MMCI0_BASE,
+        pic[INTERRUPT_VC_SDIO]);
+    sdhost = dev;
+    s = sysbus_from_qdev(dev);
+    mr = sysbus_mmio_get_region(s, 0);
+    memory_region_init_alias(per_sdhost_bus, NULL, mr,
+        0, memory_region_size(mr));
+    memory_region_add_subregion(sysmem, BUS_ADDR(MMCI0_BASE),
+        per_sdhost_bus);
+
     // DMA Channels
     dev = qdev_create(NULL, "bcm2835_dma");
     s = sysbus_from_qdev(dev);
@@ -245,6 +260,12 @@ static void raspi_init(QEMUMachineInitArgs *args)
     sysbus_connect_irq(s, 11, pic[INTERRUPT_DMA11]);
     sysbus_connect_irq(s, 12, pic[INTERRUPT_DMA12]);
 
+    // DMA request lines
+    sysbus_connect_irq(sysbus_from_qdev(emmc), 1, 
+        qdev_get_gpio_in(dev, DREQ_EMMC));
+    sysbus_connect_irq(sysbus_from_qdev(sdhost), 1,
+        qdev_get_gpio_in(dev, DREQ_SDHOST));
+
     // Finally, the board itself
     raspi_binfo.ram_size = bcm2835_vcram_base;
     raspi_binfo.kernel_filename = args->kernel_filename;